@@ -0,0 +1,47 @@
+#include "aot.h"
+
+#include <algorithm>
+#include <exception>
+
+namespace opcode {
+	namespace aot {
+		State::State(std::vector<std::int64_t> image, std::vector<std::uint8_t> code, std::function<std::int64_t()> inputFunction,
+		    std::function<void(std::int64_t)> outputFunction)
+		    : memory_{ std::move(image) }, code_{ std::move(code) }, inputFunction_{ std::move(inputFunction) }, outputFunction_{ std::move(outputFunction) }
+		{
+		}
+
+		void State::fallback(std::int64_t position)
+		{
+			auto machine = Machine{ std::move(memory_), position, relativeBase };
+			opcode::run(machine, inputFunction_, outputFunction_);
+		}
+
+		void State::markModified(std::int64_t address)
+		{
+			if (modified_.empty())
+				modified_.resize(code_.size(), 0);
+			modified_[static_cast<size_t>(address)] = 1;
+			anyModified_                            = true;
+		}
+
+		bool State::isModifiedRange(std::int64_t start, std::int64_t end) const
+		{ //
+			return std::any_of(modified_.begin() + start, modified_.begin() + end, [](auto modified) { return modified != 0; });
+		}
+
+		std::vector<std::int64_t> run(const std::vector<std::int64_t>& inputs)
+		{
+			auto next    = inputs.begin();
+			auto outputs = std::vector<std::int64_t>{};
+			run(
+			    [&]() {
+				    if (next == inputs.end())
+					    throw std::exception{ "no input available" };
+				    return *next++;
+			    },
+			    [&](std::int64_t value) { outputs.push_back(value); });
+			return outputs;
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "memory.h"
+#include "opcode.h"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace opcode {
+	namespace aot {
+		class State
+		{
+		public:
+			State(std::vector<std::int64_t> image, std::vector<std::uint8_t> code, std::function<std::int64_t()> inputFunction,
+			    std::function<void(std::int64_t)> outputFunction);
+
+			std::int64_t read(std::int64_t address) const { return memory_.read(address); }
+			void         write(std::int64_t address, std::int64_t value) { memory_.write(address, value); }
+
+			bool writeCode(std::int64_t address, std::int64_t value)
+			{
+				if (static_cast<std::uint64_t>(address) < code_.size() && code_[static_cast<size_t>(address)] && memory_.read(address) != value) {
+					memory_.write(address, value);
+					markModified(address);
+					return true;
+				}
+				memory_.write(address, value);
+				return false;
+			}
+
+			bool isModified(std::int64_t start, std::int64_t end) const { return anyModified_ && isModifiedRange(start, end); }
+
+			std::int64_t input() { return inputFunction_(); }
+			void         output(std::int64_t value) { outputFunction_(value); }
+
+			void fallback(std::int64_t position);
+
+			std::int64_t relativeBase = 0;
+
+		private:
+			void markModified(std::int64_t address);
+			bool isModifiedRange(std::int64_t start, std::int64_t end) const;
+
+			Memory                            memory_;
+			std::vector<std::uint8_t>         code_;
+			std::vector<std::uint8_t>         modified_;
+			bool                              anyModified_ = false;
+			std::function<std::int64_t()>     inputFunction_;
+			std::function<void(std::int64_t)> outputFunction_;
+		};
+
+		void run(std::function<std::int64_t()> inputFunction, std::function<void(std::int64_t)> outputFunction);
+
+		std::vector<std::int64_t> run(const std::vector<std::int64_t>& inputs);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#include "ascii.h"
+
+namespace opcode {
+	bool AsciiIn::refill()
+	{
+		if (!in_ || !std::getline(*in_, line_))
+			return false;
+
+		line_.push_back('\n');
+		text_         = line_;
+		isFromStream_ = true;
+		return true;
+	}
+
+	void AsciiIn::echoLine()
+	{
+		const auto end = text_.find('\n');
+		*echo_ << text_.substr(0, end == boost::string_view::npos ? end : end + 1);
+	}
+
+	void AsciiOut::flush()
+	{
+		if (!line_.empty())
+			putLine();
+	}
+
+	void AsciiOut::putLine()
+	{
+		if (lineFunction_)
+			lineFunction_(line_);
+		line_.clear();
+	}
+
+	void AsciiOut::putValue(std::int64_t value)
+	{
+		if (!valueFunction_)
+			throw std::exception{ "non-ASCII output" };
+		valueFunction_(value);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <string>
+
+namespace opcode {
+	// Input policy feeding a program the characters of a text, read in place, then the lines of a stream if one is given. The text
+	// must outlive the policy. With an echo stream, each line of the text is written to it as the program starts reading it.
+	class AsciiIn
+	{
+	public:
+		explicit AsciiIn(boost::string_view text = {}) : text_{ text } {}
+		explicit AsciiIn(std::istream& in) : in_{ &in } {}
+		AsciiIn(boost::string_view text, std::istream& in) : text_{ text }, in_{ &in } {}
+
+		void setEcho(std::ostream& echo) { echo_ = &echo; }
+
+		bool hasInput() { return !text_.empty() || refill(); }
+
+		std::int64_t operator()()
+		{
+			if (!hasInput())
+				throw std::exception{ "no ASCII input left" };
+			if (echo_ && isLineStart_ && !isFromStream_)
+				echoLine();
+
+			const auto c = text_.front();
+			text_.remove_prefix(1);
+			isLineStart_ = c == '\n';
+			return static_cast<std::int64_t>(c);
+		}
+
+	private:
+		bool refill();
+		void echoLine();
+
+		boost::string_view text_;
+		std::istream*      in_           = nullptr;
+		std::ostream*      echo_         = nullptr;
+		std::string        line_;
+		bool               isLineStart_  = true;
+		bool               isFromStream_ = false;
+	};
+
+	// Output policy gathering ASCII output into lines, handed to the line function without their end of line. Values outside the
+	// ASCII range, such as a final answer, go to the value function; without one they are an error.
+	class AsciiOut
+	{
+	public:
+		using LineFunction  = std::function<void(boost::string_view)>;
+		using ValueFunction = std::function<void(std::int64_t)>;
+
+		explicit AsciiOut(LineFunction lineFunction, ValueFunction valueFunction = {})
+		    : lineFunction_{ std::move(lineFunction) }, valueFunction_{ std::move(valueFunction) }
+		{
+		}
+
+		void operator()(std::int64_t value)
+		{
+			if (value < 0 || value > 127)
+				putValue(value);
+			else if (value == '\n')
+				putLine();
+			else
+				line_.push_back(static_cast<char>(value));
+		}
+
+		// Hands over the last line if the program did not end it.
+		void flush();
+
+	private:
+		void putLine();
+		void putValue(std::int64_t value);
+
+		LineFunction  lineFunction_;
+		ValueFunction valueFunction_;
+		std::string   line_;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,319 @@
+#include "batch.h"
+#include "pmode.h"
+
+#include <algorithm>
+#include <exception>
+#include <type_traits>
+
+namespace opcode {
+	namespace {
+		using namespace detail;
+
+		constexpr size_t laneBlockSize = 256;
+
+		int getNArgs(int op, int pMode1, int pMode2, int pMode3)
+		{
+			const auto isRead  = [](int pMode) { return pMode <= Relative; };
+			const auto isWrite = [](int pMode) { return pMode == Position || pMode == Relative; };
+
+			switch (op) {
+			case 1:
+			case 2:
+			case 7:
+			case 8: return isRead(pMode1) && isRead(pMode2) && isWrite(pMode3) ? 3 : -1;
+			case 3: return isWrite(pMode1) ? 1 : -1;
+			case 4:
+			case 9: return isRead(pMode1) ? 1 : -1;
+			case 5:
+			case 6: return isRead(pMode1) && isRead(pMode2) ? 2 : -1;
+			case 99: return 0;
+			default: return -1;
+			}
+		}
+	}
+
+	Batch::Batch(const std::vector<std::int64_t>& code, size_t nLanes, const Options& options)
+	    : nLanes_{ nLanes }, options_{ options }, blocks_((nLanes + laneBlockSize - 1) / laneBlockSize), overflows_(nLanes), relativeBases_(nLanes, 0),
+	      inputs_(nLanes), nextInputs_(nLanes, 0), outputs_(nLanes), failed_(nLanes, 0), nInstructions_(nLanes, 0), statuses_(nLanes, Status::Halted)
+	{
+		for (auto& block : blocks_) {
+			block.nRows = static_cast<std::int64_t>(code.size());
+			block.memory.resize(code.size() * laneBlockSize);
+			for (size_t address = 0; address < code.size(); ++address)
+				std::fill_n(block.memory.begin() + address * laneBlockSize, laneBlockSize, code[address]);
+		}
+	}
+
+	std::int64_t Batch::read(size_t lane, std::int64_t address) const
+	{
+		if (address < 0)
+			throw std::exception{ "negative address" };
+
+		const auto& block = blocks_[lane / laneBlockSize];
+		if (address < block.nRows)
+			return block.memory[address * laneBlockSize + lane % laneBlockSize];
+
+		const auto& overflow = overflows_[lane];
+		const auto  it       = overflow.find(address);
+		return it != overflow.end() ? it->second : 0;
+	}
+
+	void Batch::write(size_t lane, std::int64_t address, std::int64_t value)
+	{
+		if (address < 0)
+			throw std::exception{ "negative address" };
+		storeOutside(lane, address, value);
+	}
+
+	void Batch::run()
+	{
+		// Lanes run a block at a time so that the rows they touch stay in cache.
+		for (size_t first = 0; first < nLanes_; first += laneBlockSize) {
+			block_      = &blocks_[first / laneBlockSize];
+			auto& lanes = groups_[0];
+			for (auto lane = first; lane < std::min(first + laneBlockSize, nLanes_); ++lane)
+				lanes.push_back(lane);
+
+			// Always stepping the lowest position lets lanes that branched apart meet again at the end of loops and calls.
+			while (!groups_.empty()) {
+				if (options_.stop && options_.stop->isStopRequested())
+					return stop(first);
+
+				const auto it       = groups_.begin();
+				const auto position = it->first;
+				auto       lanes    = std::move(it->second);
+				groups_.erase(it);
+				execute(position, lanes);
+			}
+		}
+	}
+
+	// Drops the lanes that have already executed their budget, and counts one more instruction for the others.
+	bool Batch::spendBudget(std::vector<size_t>& lanes)
+	{
+		const auto isSpent = [&](size_t lane) {
+			if (nInstructions_[lane] == options_.budget) {
+				statuses_[lane] = Status::Preempted;
+				return true;
+			}
+			++nInstructions_[lane];
+			return false;
+		};
+		lanes.erase(std::remove_if(lanes.begin(), lanes.end(), isSpent), lanes.end());
+		return !lanes.empty();
+	}
+
+	// Leaves the lanes still running in this block, and those of the blocks after it, where they are.
+	void Batch::stop(size_t first)
+	{
+		for (const auto& group : groups_)
+			for (const auto lane : group.second)
+				statuses_[lane] = Status::Stopped;
+		groups_.clear();
+
+		for (auto lane = first + laneBlockSize; lane < nLanes_; ++lane)
+			statuses_[lane] = Status::Stopped;
+	}
+
+	bool Batch::reserveRows(size_t lane, std::int64_t address)
+	{
+		auto& block = blocks_[lane / laneBlockSize];
+		if (address < block.nRows)
+			return true;
+		if (address >= maxDenseRows)
+			return false;
+
+		block.nRows = std::min(maxDenseRows, std::max(address + 1, block.nRows + block.nRows / 4 + 16));
+		block.memory.resize(block.nRows * laneBlockSize, 0);
+		return true;
+	}
+
+	void Batch::execute(std::int64_t position, std::vector<size_t>& lanes)
+	{
+		// Lanes that rewrote this instruction differently are left at the same position and run as their own group.
+		const auto value = read(lanes.front(), position);
+		const auto split = std::stable_partition(lanes.begin(), lanes.end(), [&](size_t lane) { return read(lane, position) == value; });
+		if (split != lanes.end()) {
+			auto& rest = groups_[position];
+			rest.insert(rest.end(), split, lanes.end());
+			lanes.erase(split, lanes.end());
+		}
+
+		const auto op     = static_cast<int>(value % 100);
+		const auto pMode1 = static_cast<int>(value / 100 % 10);
+		const auto pMode2 = static_cast<int>(value / 1000 % 10);
+		const auto pMode3 = static_cast<int>(value / 10000 % 10);
+		const auto nArgs  = value < 0 ? -1 : getNArgs(op, pMode1, pMode2, pMode3);
+
+		if (nArgs < 0 || !reserveRows(lanes.front(), position + nArgs)) {
+			for (const auto lane : lanes)
+				fail(lane);
+			return;
+		}
+
+		if (options_.budget && op != 99 && !spendBudget(lanes))
+			return;
+
+		anyFailed_ = false;
+
+		switch (op) {
+		case 1: dispatch<1>(position, lanes, pMode1, pMode2, pMode3); break;
+		case 2: dispatch<2>(position, lanes, pMode1, pMode2, pMode3); break;
+		case 3: dispatch<3>(position, lanes, pMode1, Position, Position); break;
+		case 4: dispatch<4>(position, lanes, pMode1, Position, Position); break;
+		case 5: dispatch<5>(position, lanes, pMode1, pMode2, Position); break;
+		case 6: dispatch<6>(position, lanes, pMode1, pMode2, Position); break;
+		case 7: dispatch<7>(position, lanes, pMode1, pMode2, pMode3); break;
+		case 8: dispatch<8>(position, lanes, pMode1, pMode2, pMode3); break;
+		case 9: dispatch<9>(position, lanes, pMode1, Position, Position); break;
+		default: return;
+		}
+
+		if (anyFailed_)
+			lanes.erase(std::remove_if(lanes.begin(), lanes.end(), [&](size_t lane) { return failed_[lane] != 0; }), lanes.end());
+		if (lanes.empty())
+			return;
+
+		auto& next = groups_[position + nArgs + 1];
+		if (next.empty())
+			next.swap(lanes);
+		else
+			next.insert(next.end(), lanes.begin(), lanes.end());
+	}
+
+	template<int Op> void Batch::dispatch(std::int64_t position, std::vector<size_t>& lanes, int pMode1, int pMode2, int pMode3)
+	{
+		const auto withPMode = [](int pMode, auto&& function) {
+			switch (pMode) {
+			case Position: function(std::integral_constant<int, Position>{}); break;
+			case Immediate: function(std::integral_constant<int, Immediate>{}); break;
+			default: function(std::integral_constant<int, Relative>{}); break;
+			}
+		};
+
+		withPMode(pMode1, [&](auto m1) {
+			withPMode(pMode2, [&](auto m2) {
+				withPMode(pMode3, [&](auto m3) { this->executeLanes<Op, decltype(m1)::value, decltype(m2)::value, decltype(m3)::value>(position, lanes); });
+			});
+		});
+	}
+
+	template<int Op, int PMode1, int PMode2, int PMode3> void Batch::executeLanes(std::int64_t position, std::vector<size_t>& lanes)
+	{
+		const auto& memory = block_->memory;
+		const auto  args   = static_cast<size_t>(position + 1) * laneBlockSize;
+		const auto  arg    = [&](size_t lane, size_t i) { return memory[args + i * laneBlockSize + lane % laneBlockSize]; };
+
+		if (Op == 5 || Op == 6) {
+			auto lastTarget = std::int64_t{ -1 };
+			auto target     = static_cast<std::vector<size_t>*>(nullptr);
+			auto next       = std::vector<size_t>{};
+			for (const auto lane : lanes) {
+				const auto jumps       = (load<PMode1>(lane, arg(lane, 0)) != 0) == (Op == 5);
+				const auto destination = jumps ? load<PMode2>(lane, arg(lane, 1)) : position + 3;
+				if (destination == position + 3 || failed_[lane])
+					next.push_back(lane);
+				else if (destination < 0)
+					fail(lane);
+				else {
+					if (destination != lastTarget) {
+						lastTarget = destination;
+						target     = &groups_[destination];
+					}
+					target->push_back(lane);
+				}
+			}
+			lanes.swap(next);
+			return;
+		}
+
+		for (const auto lane : lanes) {
+			switch (Op) {
+			case 1: store<PMode3>(lane, arg(lane, 2), load<PMode1>(lane, arg(lane, 0)) + load<PMode2>(lane, arg(lane, 1))); break;
+			case 2: store<PMode3>(lane, arg(lane, 2), load<PMode1>(lane, arg(lane, 0)) * load<PMode2>(lane, arg(lane, 1))); break;
+			case 3:
+				if (nextInputs_[lane] < inputs_[lane].size())
+					store<PMode1>(lane, arg(lane, 0), inputs_[lane][nextInputs_[lane]++]);
+				else
+					fail(lane);
+				break;
+			case 4: outputs_[lane].push_back(load<PMode1>(lane, arg(lane, 0))); break;
+			case 7: store<PMode3>(lane, arg(lane, 2), load<PMode1>(lane, arg(lane, 0)) < load<PMode2>(lane, arg(lane, 1)) ? 1 : 0); break;
+			case 8: store<PMode3>(lane, arg(lane, 2), load<PMode1>(lane, arg(lane, 0)) == load<PMode2>(lane, arg(lane, 1)) ? 1 : 0); break;
+			case 9: relativeBases_[lane] += load<PMode1>(lane, arg(lane, 0)); break;
+			}
+		}
+	}
+
+	template<int PMode> std::int64_t Batch::load(size_t lane, std::int64_t arg)
+	{
+		if (PMode == Immediate)
+			return arg;
+
+		const auto address = PMode == Relative ? relativeBases_[lane] + arg : arg;
+		if (static_cast<std::uint64_t>(address) < static_cast<std::uint64_t>(block_->nRows))
+			return block_->memory[address * laneBlockSize + lane % laneBlockSize];
+		return loadOutside(lane, address);
+	}
+
+	template<int PMode> void Batch::store(size_t lane, std::int64_t arg, std::int64_t value)
+	{
+		const auto address = PMode == Relative ? relativeBases_[lane] + arg : arg;
+		if (static_cast<std::uint64_t>(address) < static_cast<std::uint64_t>(block_->nRows))
+			block_->memory[address * laneBlockSize + lane % laneBlockSize] = value;
+		else
+			storeOutside(lane, address, value);
+	}
+
+	std::int64_t Batch::loadOutside(size_t lane, std::int64_t address)
+	{
+		if (address < 0) {
+			fail(lane);
+			return 0;
+		}
+		return read(lane, address);
+	}
+
+	void Batch::storeOutside(size_t lane, std::int64_t address, std::int64_t value)
+	{
+		if (address < 0)
+			fail(lane);
+		else if (reserveRows(lane, address))
+			blocks_[lane / laneBlockSize].memory[address * laneBlockSize + lane % laneBlockSize] = value;
+		else
+			overflows_[lane][address] = value;
+	}
+
+	void Batch::fail(size_t lane)
+	{
+		failed_[lane] = 1;
+		anyFailed_    = true;
+	}
+
+	std::vector<std::vector<std::int64_t>> runBatch(
+	    const std::vector<std::int64_t>& code, const std::vector<std::vector<std::int64_t>>& inputs, const Options& options)
+	{
+		// Only the outputs are kept, so each block of lanes gets its own batch, freed before the next block is built.
+		auto outputs = std::vector<std::vector<std::int64_t>>{};
+		for (size_t first = 0; first < inputs.size(); first += laneBlockSize) {
+			const auto nLanes = std::min(laneBlockSize, inputs.size() - first);
+
+			auto batch = Batch{ code, nLanes, options };
+			for (size_t lane = 0; lane < nLanes; ++lane)
+				for (const auto value : inputs[first + lane])
+					batch.pushInput(lane, value);
+			batch.run();
+
+			for (size_t lane = 0; lane < nLanes; ++lane) {
+				if (batch.hasFailed(lane))
+					throw std::exception{ "batch lane failed" };
+				if (batch.getStatus(lane) == Status::Preempted)
+					throw std::exception{ "instruction budget spent" };
+				if (batch.getStatus(lane) == Status::Stopped)
+					throw std::exception{ "run stopped" };
+				outputs.push_back(batch.getOutputs(lane));
+			}
+		}
+		return outputs;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "opcode.h"
+
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+namespace opcode {
+	// Runs many instances of one program in lockstep. Lanes are split into blocks, and each block stores its memory as one
+	// row of lanes per address, so lanes executing the same instruction touch neighbouring values. Rows grow with the addresses
+	// written up to a limit; values further away are kept per lane, and code cannot run from there. Each lane may execute the budget
+	// in the options; a lane that spends it, or every lane once the stop source is requested, is left where it is and the run goes on
+	// without it. Lanes cannot be resumed.
+	class Batch
+	{
+	public:
+		Batch(const std::vector<std::int64_t>& code, size_t nLanes, const Options& options = {});
+
+		size_t getNLanes() const { return nLanes_; }
+
+		std::int64_t read(size_t lane, std::int64_t address) const;
+		void         write(size_t lane, std::int64_t address, std::int64_t value);
+
+		void pushInput(size_t lane, std::int64_t value) { inputs_[lane].push_back(value); }
+
+		const std::vector<std::int64_t>& getOutputs(size_t lane) const { return outputs_[lane]; }
+		bool                             hasFailed(size_t lane) const { return failed_[lane] != 0; }
+
+		// Status::Preempted or Status::Stopped for a lane the run left, and Status::Halted otherwise.
+		Status getStatus(size_t lane) const { return statuses_[lane]; }
+
+		void run();
+
+	private:
+		struct LaneBlock
+		{
+			std::int64_t              nRows = 0;
+			std::vector<std::int64_t> memory;
+		};
+
+		static constexpr std::int64_t maxDenseRows = std::int64_t{ 1 } << 12;
+
+		bool reserveRows(size_t lane, std::int64_t address);
+		bool spendBudget(std::vector<size_t>& lanes);
+		void stop(size_t first);
+
+		void execute(std::int64_t position, std::vector<size_t>& lanes);
+
+		template<int Op> void dispatch(std::int64_t position, std::vector<size_t>& lanes, int pMode1, int pMode2, int pMode3);
+
+		template<int Op, int PMode1, int PMode2, int PMode3> void executeLanes(std::int64_t position, std::vector<size_t>& lanes);
+
+		template<int PMode> std::int64_t load(size_t lane, std::int64_t arg);
+		template<int PMode> void         store(size_t lane, std::int64_t arg, std::int64_t value);
+
+		std::int64_t loadOutside(size_t lane, std::int64_t address);
+		void         storeOutside(size_t lane, std::int64_t address, std::int64_t value);
+		void         fail(size_t lane);
+
+		size_t                                                      nLanes_;
+		Options                                                     options_;
+		std::vector<LaneBlock>                                      blocks_;
+		LaneBlock*                                                  block_ = nullptr;
+		std::vector<std::unordered_map<std::int64_t, std::int64_t>> overflows_;
+		std::vector<std::int64_t>                                   relativeBases_;
+		std::vector<std::vector<std::int64_t>>                      inputs_;
+		std::vector<size_t>                                         nextInputs_;
+		std::vector<std::vector<std::int64_t>>                      outputs_;
+		std::vector<std::uint8_t>                                   failed_;
+		std::vector<std::uint64_t>                                  nInstructions_;
+		std::vector<Status>                                         statuses_;
+		bool                                                        anyFailed_ = false;
+		std::map<std::int64_t, std::vector<size_t>>                 groups_;
+	};
+
+	// Throws if a lane fails, spends its budget or is stopped.
+	std::vector<std::vector<std::int64_t>> runBatch(
+	    const std::vector<std::int64_t>& code, const std::vector<std::vector<std::int64_t>>& inputs, const Options& options = {});
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#include "cache.h"
+
+#include <algorithm>
+
+namespace opcode {
+	CachedRunner::CachedRunner(std::vector<std::int64_t> code, size_t capacity, const Options& options)
+	    : code_{ std::move(code) }, capacity_{ std::max(capacity, size_t{ 1 }) }, options_{ options }, runners_{ [this] { return Runner{ code_, options_ }; } }
+	{
+	}
+
+	std::vector<std::int64_t> CachedRunner::run(const std::vector<std::int64_t>& inputs)
+	{
+		{
+			std::lock_guard<std::mutex> lock{ mutex_ };
+			const auto                  it = index_.find(inputs);
+			if (it != index_.end()) {
+				entries_.splice(entries_.begin(), entries_, it->second);
+				++nHits_;
+				return it->second->second;
+			}
+		}
+
+		// Runs outside the lock, so concurrent misses on the same inputs may both run the program.
+		auto& runner = runners_.local();
+		runner.reset();
+		runner.pushInputs(inputs);
+		auto outputs = runner.run();
+		++nMisses_;
+
+		std::lock_guard<std::mutex> lock{ mutex_ };
+		if (index_.count(inputs))
+			return outputs;
+
+		entries_.emplace_front(inputs, outputs);
+		index_.emplace(inputs, entries_.begin());
+		if (entries_.size() > capacity_) {
+			index_.erase(entries_.back().first);
+			entries_.pop_back();
+		}
+		return outputs;
+	}
+}
\ No newline at end of file
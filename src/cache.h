@@ -0,0 +1,48 @@
+#pragma once
+
+#include "opcode.h"
+
+#include <atomic>
+#include <boost/functional/hash.hpp>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <tbb/enumerable_thread_specific.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace opcode {
+	// Memoizes the outputs of a program that reads a fixed list of inputs and halts, keeping the most recently used results.
+	// Runs that do not halt, because they need more inputs than given, spend their budget or are stopped, throw and are not cached.
+	// All members can be called from several threads.
+	class CachedRunner
+	{
+	public:
+		explicit CachedRunner(std::vector<std::int64_t> code, size_t capacity = size_t{ 1 } << 16, const Options& options = {});
+
+		CachedRunner(const CachedRunner&) = delete;
+		CachedRunner& operator=(const CachedRunner&) = delete;
+
+		const std::vector<std::int64_t>& getCode() const { return code_; }
+
+		std::vector<std::int64_t> run(const std::vector<std::int64_t>& inputs);
+
+		std::uint64_t getNHits() const { return nHits_; }
+		std::uint64_t getNMisses() const { return nMisses_; }
+
+	private:
+		using Key   = std::vector<std::int64_t>;
+		using Entry = std::pair<Key, std::vector<std::int64_t>>;
+
+		const std::vector<std::int64_t>                                       code_;
+		const size_t                                                          capacity_;
+		const Options                                                         options_;
+		std::mutex                                                            mutex_;
+		std::list<Entry>                                                      entries_;
+		std::unordered_map<Key, std::list<Entry>::iterator, boost::hash<Key>> index_;
+		std::atomic<std::uint64_t>                                            nHits_{ 0 };
+		std::atomic<std::uint64_t>                                            nMisses_{ 0 };
+		tbb::enumerable_thread_specific<Runner>                               runners_;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "cfg.h"
+#include "pmode.h"
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+
+namespace opcode {
+	namespace {
+		using namespace detail;
+
+		bool isJump(int op) { return op == 5 || op == 6; }
+	}
+
+	bool decodeInstruction(const std::vector<std::int64_t>& image, std::int64_t position, DecodedInstruction& instruction)
+	{
+		if (position < 0 || position >= static_cast<std::int64_t>(image.size()) || image[position] < 0)
+			return false;
+
+		const auto value   = image[position];
+		instruction.op     = static_cast<int>(value % 100);
+		instruction.nArgs  = 0;
+		const auto pMode1  = static_cast<int>(value / 100 % 10);
+		const auto pMode2  = static_cast<int>(value / 1000 % 10);
+		const auto pMode3  = static_cast<int>(value / 10000 % 10);
+		const auto isRead  = [](int pMode) { return pMode <= Relative; };
+		const auto isWrite = [](int pMode) { return pMode == Position || pMode == Relative; };
+
+		switch (instruction.op) {
+		case 1:
+		case 2:
+		case 7:
+		case 8: instruction.nArgs = isRead(pMode1) && isRead(pMode2) && isWrite(pMode3) ? 3 : -1; break;
+		case 3: instruction.nArgs = isWrite(pMode1) ? 1 : -1; break;
+		case 4:
+		case 9: instruction.nArgs = isRead(pMode1) ? 1 : -1; break;
+		case 5:
+		case 6: instruction.nArgs = isRead(pMode1) && isRead(pMode2) ? 2 : -1; break;
+		case 99: instruction.nArgs = 0; break;
+		default: instruction.nArgs = -1; break;
+		}
+
+		instruction.pModes[0] = pMode1;
+		instruction.pModes[1] = pMode2;
+		instruction.pModes[2] = pMode3;
+		return instruction.nArgs >= 0 && position + instruction.nArgs < static_cast<std::int64_t>(image.size());
+	}
+
+	ControlFlowGraph::ControlFlowGraph(std::vector<std::int64_t> image) : image_{ std::move(image) }, code_(image_.size(), false)
+	{
+		const auto starts = findBlockStarts();
+		for (const auto start : starts)
+			blocks_.push_back(buildBlock(start, starts));
+	}
+
+	const BasicBlock* ControlFlowGraph::findBlock(std::int64_t start) const
+	{
+		const auto isBefore = [](const BasicBlock& block, std::int64_t position) { return block.start < position; };
+		const auto it       = std::lower_bound(blocks_.begin(), blocks_.end(), start, isBefore);
+		return it != blocks_.end() && it->start == start ? &*it : nullptr;
+	}
+
+	std::vector<OpcodePair> ControlFlowGraph::findOpcodePairs() const
+	{
+		auto counts = std::map<std::pair<std::int64_t, std::int64_t>, std::size_t>{};
+		for (const auto& block : blocks_) {
+			auto instruction = DecodedInstruction{};
+			auto previous    = std::int64_t{ -1 };
+			for (auto position = block.start; position < block.end && decodeInstruction(image_, position, instruction); position += instruction.nArgs + 1) {
+				if (previous >= 0)
+					++counts[{ image_[previous], image_[position] }];
+				previous = position;
+			}
+		}
+
+		auto pairs = std::vector<OpcodePair>{};
+		for (const auto& count : counts)
+			pairs.push_back({ count.first.first, count.first.second, count.second });
+		std::stable_sort(pairs.begin(), pairs.end(), [](const OpcodePair& a, const OpcodePair& b) { return a.count > b.count; });
+		return pairs;
+	}
+
+	std::vector<std::int64_t> ControlFlowGraph::findBlockStarts() const
+	{
+		auto pending = std::deque<std::int64_t>{ 0 };
+		auto visited = std::set<std::int64_t>{};
+		auto starts  = std::set<std::int64_t>{};
+		auto add     = [&](std::int64_t position) {
+			if (position >= 0 && position < static_cast<std::int64_t>(image_.size()) && !visited.count(position))
+				pending.push_back(position);
+		};
+
+		while (!pending.empty()) {
+			const auto start = pending.front();
+			pending.pop_front();
+			if (!visited.insert(start).second)
+				continue;
+
+			auto instruction = DecodedInstruction{};
+			if (!decodeInstruction(image_, start, instruction))
+				continue;
+			starts.insert(start);
+
+			for (auto position = start; decodeInstruction(image_, position, instruction); position += instruction.nArgs + 1) {
+				const auto* args = &image_[position + 1];
+
+				// Return addresses are pushed as constants, so an immediate sum or product is a likely jump target.
+				if ((instruction.op == 1 || instruction.op == 2) && instruction.pModes[0] == Immediate && instruction.pModes[1] == Immediate)
+					add(instruction.op == 1 ? args[0] + args[1] : args[0] * args[1]);
+				if (isJump(instruction.op)) {
+					if (instruction.pModes[1] == Immediate)
+						add(args[1]);
+					add(position + 3);
+					break;
+				}
+				if (instruction.op == 99)
+					break;
+			}
+		}
+		return { starts.begin(), starts.end() };
+	}
+
+	BasicBlock ControlFlowGraph::buildBlock(std::int64_t start, const std::vector<std::int64_t>& starts)
+	{
+		const auto isStart = [&](std::int64_t position) { return std::binary_search(starts.begin(), starts.end(), position); };
+
+		auto block       = BasicBlock{};
+		auto instruction = DecodedInstruction{};
+		block.start      = start;
+		block.end        = start;
+		while ((block.end == start || !isStart(block.end)) && decodeInstruction(image_, block.end, instruction)) {
+			const auto position = block.end;
+			for (auto i = position; i <= position + instruction.nArgs; ++i)
+				code_[i] = true;
+			block.end += instruction.nArgs + 1;
+
+			if (instruction.op == 99)
+				return block;
+
+			if (isJump(instruction.op)) {
+				const auto* args        = &image_[position + 1];
+				const auto  isConstant  = instruction.pModes[0] == Immediate;
+				const auto  canJump     = !isConstant || (args[0] != 0) == (instruction.op == 5);
+				const auto  canContinue = !isConstant || !canJump;
+
+				if (canJump && instruction.pModes[1] == Immediate)
+					block.successors.push_back(args[1]);
+				else if (canJump)
+					block.dynamicExit = true;
+				if (canContinue)
+					block.successors.push_back(block.end);
+				return block;
+			}
+		}
+
+		if (block.end != start && isStart(block.end))
+			block.successors.push_back(block.end);
+		return block;
+	}
+}
\ No newline at end of file
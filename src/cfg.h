@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace opcode {
+	struct DecodedInstruction
+	{
+		int op = 0, nArgs = 0;
+		int pModes[3] = {};
+	};
+
+	bool decodeInstruction(const std::vector<std::int64_t>& image, std::int64_t position, DecodedInstruction& instruction);
+
+	struct BasicBlock
+	{
+		std::int64_t              start = 0, end = 0;
+		std::vector<std::int64_t> successors;
+		bool                      dynamicExit = false;
+	};
+
+	struct OpcodePair
+	{
+		std::int64_t first = 0, second = 0;
+		std::size_t  count = 0;
+	};
+
+	class ControlFlowGraph
+	{
+	public:
+		explicit ControlFlowGraph(std::vector<std::int64_t> image);
+
+		const std::vector<BasicBlock>& getBlocks() const { return blocks_; }
+		const BasicBlock*              findBlock(std::int64_t start) const;
+
+		bool isBlockStart(std::int64_t position) const { return findBlock(position) != nullptr; }
+		bool isCode(std::int64_t position) const { return position >= 0 && position < static_cast<std::int64_t>(code_.size()) && code_[position]; }
+
+		std::vector<OpcodePair> findOpcodePairs() const;
+
+	private:
+		std::vector<std::int64_t> findBlockStarts() const;
+		BasicBlock                buildBlock(std::int64_t start, const std::vector<std::int64_t>& starts);
+
+		std::vector<std::int64_t> image_;
+		std::vector<BasicBlock>   blocks_;
+		std::vector<bool>         code_;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,82 @@
+#include "channel.h"
+
+#include <thread>
+
+namespace opcode {
+	Channel::Channel(size_t capacity, bool parkReader) : parkReader_{ parkReader }
+	{
+		auto size = batchSize;
+		while (size < capacity)
+			size <<= 1;
+		buffer_.resize(size);
+		mask_ = size - 1;
+	}
+
+	void Channel::push(std::int64_t value)
+	{
+		while (stagedTail_ - cachedHead_ == buffer_.size()) {
+			cachedHead_ = head_.load(std::memory_order_acquire);
+			if (stagedTail_ - cachedHead_ == buffer_.size()) {
+				publish(stagedTail_);
+				std::this_thread::yield();
+			}
+		}
+
+		buffer_[stagedTail_ & mask_] = value;
+		if (++stagedTail_ % batchSize == 0)
+			publish(stagedTail_);
+	}
+
+	void Channel::flush()
+	{
+		if (tail_.load(std::memory_order_relaxed) != stagedTail_)
+			publish(stagedTail_);
+	}
+
+	bool Channel::tryPop(std::int64_t& value)
+	{
+		const auto head = head_.load(std::memory_order_relaxed);
+		if (head == cachedTail_) {
+			cachedTail_ = tail_.load(std::memory_order_acquire);
+			if (head == cachedTail_)
+				return false;
+		}
+
+		value = buffer_[head & mask_];
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	std::int64_t Channel::pop()
+	{
+		auto value = std::int64_t{};
+		for (auto i = 0; !tryPop(value); ++i) {
+			if (i < nSpins)
+				continue;
+			if (parkReader_)
+				park();
+			else
+				std::this_thread::yield();
+		}
+		return value;
+	}
+
+	void Channel::publish(std::uint64_t tail)
+	{
+		// Sequentially consistent so that either the reader sees the new tail or the writer sees the reader waiting.
+		tail_.store(tail, std::memory_order_seq_cst);
+		if (waiting_.load(std::memory_order_seq_cst)) {
+			std::lock_guard<std::mutex> lock{ mutex_ };
+			wakeUp_.notify_one();
+		}
+	}
+
+	void Channel::park()
+	{
+		std::unique_lock<std::mutex> lock{ mutex_ };
+		waiting_.store(true, std::memory_order_seq_cst);
+		const auto head = head_.load(std::memory_order_relaxed);
+		wakeUp_.wait(lock, [&] { return tail_.load(std::memory_order_seq_cst) != head; });
+		waiting_.store(false, std::memory_order_relaxed);
+	}
+}
\ No newline at end of file
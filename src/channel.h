@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace opcode {
+	// Single-producer single-consumer ring of values between two machines. The producer stages values and publishes them in
+	// batches, so it must flush before it waits on anything else. A reader that finds the channel empty spins for a while and
+	// then, if parking is enabled, sleeps until the next publish instead of burning its core. Since the reader blocks, machines
+	// connected by channels need a thread each rather than a task of a pool, whose tasks may never all be scheduled at once.
+	class Channel
+	{
+	public:
+		explicit Channel(size_t capacity = 1024, bool parkReader = true);
+
+		Channel(const Channel&) = delete;
+		Channel& operator=(const Channel&) = delete;
+
+		void push(std::int64_t value);
+		void flush();
+
+		bool         tryPop(std::int64_t& value);
+		std::int64_t pop();
+
+	private:
+		static constexpr size_t cacheLineSize = 64;
+		static constexpr size_t batchSize     = 16;
+		static constexpr int    nSpins        = 1024;
+
+		void publish(std::uint64_t tail);
+		void park();
+
+		std::vector<std::int64_t> buffer_;
+		std::uint64_t             mask_;
+		bool                      parkReader_;
+
+		alignas(cacheLineSize) std::atomic<std::uint64_t> head_{ 0 };
+		alignas(cacheLineSize) std::atomic<std::uint64_t> tail_{ 0 };
+		alignas(cacheLineSize) std::uint64_t stagedTail_ = 0;
+		std::uint64_t                        cachedHead_ = 0;
+		alignas(cacheLineSize) std::uint64_t cachedTail_ = 0;
+		std::atomic<bool>                    waiting_{ false };
+		std::mutex                           mutex_;
+		std::condition_variable              wakeUp_;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,177 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <array>
+#include <exception>
+#include <fstream>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace opcode {
+	namespace {
+		const std::uint64_t checkpointMagic = 0x32504343544e49; // "INTCCP2"
+		const size_t        headerSize      = 3 * sizeof(std::uint64_t);
+		const size_t        chunkSize       = size_t{ 1 } << 16;
+
+		class MappedFile
+		{
+		public:
+			explicit MappedFile(const std::string& path)
+			{
+				// The destructor does not run when the constructor throws, so what was opened so far is closed here.
+				try {
+					open(path);
+				}
+				catch (...) {
+					close();
+					throw;
+				}
+			}
+
+			~MappedFile() { close(); }
+
+			MappedFile(const MappedFile&) = delete;
+			MappedFile& operator=(const MappedFile&) = delete;
+
+			const char* getData() const { return static_cast<const char*>(data_); }
+			size_t      getSize() const { return size_; }
+
+		private:
+			void open(const std::string& path)
+			{
+#if defined(_WIN32)
+				file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+				auto size = LARGE_INTEGER{};
+				if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size))
+					throw std::exception{ "cannot open checkpoint" };
+				size_ = static_cast<size_t>(size.QuadPart);
+				if (size_ == 0)
+					return;
+				mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				data_    = mapping_ ? MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0) : nullptr;
+#else
+				file_ = ::open(path.c_str(), O_RDONLY);
+				struct stat info;
+				if (file_ < 0 || fstat(file_, &info) != 0)
+					throw std::exception{ "cannot open checkpoint" };
+				size_ = static_cast<size_t>(info.st_size);
+				if (size_ == 0)
+					return;
+				const auto data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, file_, 0);
+				data_           = data == MAP_FAILED ? nullptr : data;
+#endif
+				if (!data_)
+					throw std::exception{ "cannot map checkpoint" };
+			}
+
+			void close()
+			{
+#if defined(_WIN32)
+				if (data_)
+					UnmapViewOfFile(data_);
+				if (mapping_)
+					CloseHandle(mapping_);
+				if (file_ != INVALID_HANDLE_VALUE)
+					CloseHandle(file_);
+#else
+				if (data_)
+					munmap(data_, size_);
+				if (file_ >= 0)
+					::close(file_);
+#endif
+			}
+
+#if defined(_WIN32)
+			HANDLE file_    = INVALID_HANDLE_VALUE;
+			HANDLE mapping_ = nullptr;
+#else
+			int file_ = -1;
+#endif
+			void*  data_ = nullptr;
+			size_t size_ = 0;
+		};
+
+		// FNV-1a over the bytes of the words.
+		std::uint64_t getCodeHash(const std::vector<std::int64_t>& code)
+		{
+			auto hash = std::uint64_t{ 0xcbf29ce484222325 };
+			for (const auto word : code) {
+				for (auto shift = 0; shift < 64; shift += 8) {
+					hash ^= (static_cast<std::uint64_t>(word) >> shift) & 0xff;
+					hash *= 0x100000001b3;
+				}
+			}
+			return hash;
+		}
+
+		std::uint64_t readHeader(const char* header, const std::vector<std::int64_t>& code)
+		{
+			const auto magic    = reinterpret_cast<const std::uint64_t*>(header)[0];
+			const auto codeHash = reinterpret_cast<const std::uint64_t*>(header)[1];
+			const auto nWords   = reinterpret_cast<const std::uint64_t*>(header)[2];
+			if (magic != checkpointMagic)
+				throw std::exception{ "not an intcode checkpoint" };
+			if (codeHash != getCodeHash(code))
+				throw std::exception{ "checkpoint of another program" };
+			return nWords;
+		}
+	}
+
+	void writeCheckpoint(std::ostream& out, const std::vector<std::int64_t>& code, const Machine& machine)
+	{
+		const auto words  = machine.saveState();
+		const auto header = std::array<std::uint64_t, 3>{ checkpointMagic, getCodeHash(code), static_cast<std::uint64_t>(words.size()) };
+		out.write(reinterpret_cast<const char*>(header.data()), headerSize);
+		out.write(reinterpret_cast<const char*>(words.data()), static_cast<std::streamsize>(words.size() * sizeof(std::int64_t)));
+	}
+
+	Machine readCheckpoint(std::istream& in, const std::vector<std::int64_t>& code, const Options& options)
+	{
+		std::uint64_t header[3];
+		in.read(reinterpret_cast<char*>(header), headerSize);
+		if (!in)
+			throw std::exception{ "not an intcode checkpoint" };
+
+		// Read by chunks, so that a corrupted size fails on the end of the stream rather than on a huge allocation.
+		const auto nWords = readHeader(reinterpret_cast<const char*>(header), code);
+		auto       words  = std::vector<std::int64_t>{};
+		while (words.size() < nWords) {
+			const auto offset = words.size();
+			words.resize(offset + static_cast<size_t>(std::min<std::uint64_t>(nWords - offset, chunkSize)));
+			in.read(reinterpret_cast<char*>(words.data() + offset), static_cast<std::streamsize>((words.size() - offset) * sizeof(std::int64_t)));
+			if (!in)
+				throw std::exception{ "truncated intcode checkpoint" };
+		}
+		return Machine::loadState(words.data(), words.size(), options);
+	}
+
+	void saveCheckpoint(const std::string& path, const std::vector<std::int64_t>& code, const Machine& machine)
+	{
+		auto out = std::ofstream{ path, std::ios::binary };
+		writeCheckpoint(out, code, machine);
+		if (!out)
+			throw std::exception{ "cannot write checkpoint" };
+	}
+
+	Machine loadCheckpoint(const std::string& path, const std::vector<std::int64_t>& code, const Options& options)
+	{
+		const MappedFile file{ path };
+		if (file.getSize() < headerSize)
+			throw std::exception{ "not an intcode checkpoint" };
+
+		const auto nWords = readHeader(file.getData(), code);
+		if (nWords != (file.getSize() - headerSize) / sizeof(std::int64_t) || (file.getSize() - headerSize) % sizeof(std::int64_t) != 0)
+			throw std::exception{ "truncated intcode checkpoint" };
+		return Machine::loadState(reinterpret_cast<const std::int64_t*>(file.getData() + headerSize), static_cast<size_t>(nWords), options);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "opcode.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace opcode {
+	// Checkpoints hold a machine's memory, registers and pending inputs and outputs, so that a long run can be picked up from disk
+	// instead of replayed. Words are stored in the byte order of the machine that wrote them. The code is the program the machine
+	// was started from: a hash of it is recorded, and reading the checkpoint back for another program fails.
+	void    writeCheckpoint(std::ostream& out, const std::vector<std::int64_t>& code, const Machine& machine);
+	Machine readCheckpoint(std::istream& in, const std::vector<std::int64_t>& code, const Options& options = {});
+
+	void saveCheckpoint(const std::string& path, const std::vector<std::int64_t>& code, const Machine& machine);
+
+	// Maps the file in memory and builds the machine straight from the mapped words.
+	Machine loadCheckpoint(const std::string& path, const std::vector<std::int64_t>& code, const Options& options = {});
+}
\ No newline at end of file
@@ -3,12 +3,10 @@
 #include "opcode.h"
 #include "robot.h"
 
-#include <boost/config.hpp>
-#include <boost/graph/adjacency_list.hpp>
-#include <boost/graph/dijkstra_shortest_paths.hpp>
-#include <boost/graph/graph_traits.hpp>
-#include <boost/graph/properties.hpp>
-#include <boost/property_map/property_map.hpp>
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <tbb/parallel_for.h>
 
 namespace {
 	enum class Direction { NORTH = 1, SOUTH = 2, WEST = 3, EAST = 4 };
@@ -27,105 +25,152 @@ namespace {
 		return position;
 	}
 
-	Direction opposite(Direction direction)
+	// Dense map of the explored area, grown around the start as the droids get further from it. Unknown cells are blank.
+	class Map
 	{
-		switch (direction) {
-		case Direction::NORTH: return Direction::SOUTH;
-		case Direction::SOUTH: return Direction::NORTH;
-		case Direction::WEST: return Direction::EAST;
-		case Direction::EAST: return Direction::WEST;
-		default: throw std::exception{ "unsupported direction " };
+	public:
+		char get(const robot::Position& position) const { return contains(position) ? cells_(toIJ(position)) : ' '; }
+
+		void set(const robot::Position& position, char value)
+		{
+			if (!contains(position))
+				grow(position);
+			cells_(toIJ(position)) = value;
 		}
-	}
 
-	char getValueAt(const std::unordered_map<robot::Position, char>& map, const robot::Position& position)
-	{
-		if (map.count(position) > 0)
-			return map.at(position);
-		return ' ';
-	}
+		const image::Image<char>& getCells() const { return cells_; }
+
+	private:
+		bool contains(const robot::Position& position) const
+		{
+			return position.i >= origin_.i && position.j >= origin_.j && position.i < origin_.i + static_cast<std::int64_t>(cells_.getWidth())
+			    && position.j < origin_.j + static_cast<std::int64_t>(cells_.getHeight());
+		}
+
+		image::IJ toIJ(const robot::Position& position) const
+		{
+			return { static_cast<size_t>(position.i - origin_.i), static_cast<size_t>(position.j - origin_.j) };
+		}
+
+		void grow(const robot::Position& position)
+		{
+			const auto margin = std::max<std::int64_t>(16, std::max(cells_.getWidth(), cells_.getHeight()) / 2);
+			const auto minI   = std::min(origin_.i, position.i - margin);
+			const auto minJ   = std::min(origin_.j, position.j - margin);
+			const auto maxI   = std::max(origin_.i + static_cast<std::int64_t>(cells_.getWidth()), position.i + margin + 1);
+			const auto maxJ   = std::max(origin_.j + static_cast<std::int64_t>(cells_.getHeight()), position.j + margin + 1);
+
+			auto cells = image::Image<char>{ static_cast<size_t>(maxI - minI), static_cast<size_t>(maxJ - minJ), ' ' };
+			for (size_t j = 0; j < cells_.getHeight(); ++j)
+				for (size_t i = 0; i < cells_.getWidth(); ++i)
+					cells(i + static_cast<size_t>(origin_.i - minI), j + static_cast<size_t>(origin_.j - minJ)) = cells_(i, j);
+
+			cells_  = std::move(cells);
+			origin_ = { minI, minJ };
+		}
+
+		image::Image<char> cells_;
+		robot::Position    origin_;
+	};
 
-	struct EndException : std::exception
+	struct Droid
 	{
+		robot::Position position;
+		opcode::Machine machine;
 	};
 
-	using Weight         = size_t;
-	using WeightProperty = boost::property<boost::edge_weight_t, Weight>;
-	using NameProperty   = boost::property<boost::vertex_name_t, robot::Position>;
-	using Graph          = boost::adjacency_list<boost::listS, boost::vecS, boost::directedS, NameProperty, WeightProperty>;
-	using Vertex         = boost::graph_traits<Graph>::vertex_descriptor;
-	using IndexMap       = boost::property_map<Graph, boost::vertex_index_t>::type;
-	using NameMap        = boost::property_map<Graph, boost::vertex_name_t>::type;
-	using PredecessorMap = boost::iterator_property_map<Vertex*, IndexMap, Vertex, Vertex&>;
-	using DistanceMap    = boost::iterator_property_map<Weight*, IndexMap, Weight, Weight&>;
-
-	Graph makeGraph(const std::unordered_map<robot::Position, char>& map, std::unordered_map<robot::Position, Vertex>& vertices)
+	char move(opcode::Machine& machine, Direction direction)
 	{
-		Graph g;
-
-		for (auto&& entry : map)
-			vertices[entry.first] = add_vertex(entry.first, g);
-
-		for (auto&& entry : map) {
-			for (const auto& direction : getAllDirections()) {
-				const auto position1 = entry.first;
-				const auto position2 = forwarded(position1, direction);
-				const auto value1    = getValueAt(map, position1);
-				const auto value2    = getValueAt(map, position2);
-				if (value1 != ' ' && value1 != '#' && value2 != ' ' && value2 != '#') {
-					add_edge(vertices.at(position1), vertices.at(position2), 1, g);
-					add_edge(vertices.at(position2), vertices.at(position1), 1, g);
-				}
-			}
+		machine.pushInput(static_cast<std::int64_t>(direction));
+		if (machine.resume() != opcode::Status::Output)
+			throw std::exception{ "droid did not report its move" };
+
+		switch (machine.popOutput()) {
+		case 0: return '#';
+		case 1: return '.';
+		case 2: return 'A';
+		default: throw std::exception{ "unsupported output" };
 		}
-
-		return g;
 	}
 
-	void dijkstra(const Graph& g, const std::unordered_map<robot::Position, Vertex>& vertices, const robot::Position& from,
-	    std::unordered_map<robot::Position, size_t>& distances)
+	// Maps the area breadth first. Every open cell of the frontier has its own droid, which is forked once for each unknown neighbour, so
+	// no droid ever walks back; the droids of a frontier move in parallel. Each unknown cell is given to a single droid.
+	image::Image<char> explore(const std::vector<std::int64_t>& code)
 	{
-		auto predecessorsBuffer = std::vector<Vertex>(num_vertices(g));
-		auto distancesBuffer    = std::vector<Weight>(num_vertices(g));
-
-		auto indexMap       = get(boost::vertex_index, g);
-		auto predecessorMap = PredecessorMap(&predecessorsBuffer[0], indexMap);
-		auto distanceMap    = DistanceMap(&distancesBuffer[0], indexMap);
+		auto map      = Map{};
+		auto frontier = std::vector<Droid>{};
+		map.set({}, 'D');
+		frontier.push_back({ {}, opcode::Machine{ code } });
+
+		while (!frontier.empty()) {
+			auto moves = std::vector<std::vector<Direction>>(frontier.size());
+			for (size_t k = 0; k < frontier.size(); ++k) {
+				for (const auto direction : getAllDirections()) {
+					const auto position = forwarded(frontier[k].position, direction);
+					if (map.get(position) == ' ') {
+						map.set(position, '?');
+						moves[k].push_back(direction);
+					}
+				}
+			}
 
-		dijkstra_shortest_paths(g, vertices.at(from), distance_map(distanceMap).predecessor_map(predecessorMap));
+			auto tiles    = std::vector<std::vector<char>>(frontier.size());
+			auto children = std::vector<std::vector<Droid>>(frontier.size());
+			tbb::parallel_for(size_t{ 0 }, frontier.size(), [&](size_t k) {
+				auto& droid = frontier[k];
+				for (size_t n = 0; n < moves[k].size(); ++n) {
+					// The last move takes the droid itself rather than a fork.
+					auto child = n + 1 < moves[k].size() ? droid.machine.fork() : std::move(droid.machine);
+					tiles[k].push_back(move(child, moves[k][n]));
+					if (tiles[k].back() != '#')
+						children[k].push_back({ forwarded(droid.position, moves[k][n]), std::move(child) });
+				}
+			});
+
+			auto next = std::vector<Droid>{};
+			for (size_t k = 0; k < frontier.size(); ++k) {
+				for (size_t n = 0; n < moves[k].size(); ++n)
+					map.set(forwarded(frontier[k].position, moves[k][n]), tiles[k][n]);
+				for (auto& child : children[k])
+					next.push_back(std::move(child));
+			}
+			frontier = std::move(next);
+		}
 
-		for (const auto& vertex : vertices)
-			distances[vertex.first] = distanceMap[vertex.second];
+		return map.getCells();
 	}
 
-	std::unordered_map<robot::Position, size_t> getDistancesMap(const std::unordered_map<robot::Position, char>& map, const robot::Position& from)
+	// Number of moves from the start to every open cell of the map, or the maximum value for walls and unknown cells.
+	image::Image<size_t> getDistances(const image::Image<char>& map, const image::IJ& from)
 	{
-		auto vertices  = std::unordered_map<robot::Position, Vertex>{};
-		auto distances = std::unordered_map<robot::Position, size_t>{};
-
-		const auto g = makeGraph(map, vertices);
-		dijkstra(g, vertices, from, distances);
-
+		auto distances = image::Image<size_t>{ map.getWidth(), map.getHeight(), std::numeric_limits<size_t>::max() };
+		auto queue     = std::deque<image::IJ>{ from };
+		distances(from) = 0;
+
+		while (!queue.empty()) {
+			const auto ij = queue.front();
+			queue.pop_front();
+
+			for (const auto next : { image::IJ{ ij.i - 1, ij.j }, image::IJ{ ij.i + 1, ij.j }, image::IJ{ ij.i, ij.j - 1 }, image::IJ{ ij.i, ij.j + 1 } }) {
+				if (map.isValid(next) && map(next) != '#' && map(next) != ' ' && distances(next) == std::numeric_limits<size_t>::max()) {
+					distances(next) = distances(ij) + 1;
+					queue.push_back(next);
+				}
+			}
+		}
 		return distances;
 	}
 
-	size_t getNearestPathLength(const std::unordered_map<robot::Position, char>& map)
-	{
-		const auto from = std::find_if(map.begin(), map.end(), [](auto&& entry) { return entry.second == 'D'; })->first;
-		const auto to   = std::find_if(map.begin(), map.end(), [](auto&& entry) { return entry.second == 'A'; })->first;
+	size_t getNearestPathLength(const image::Image<char>& map) { return getDistances(map, map.findIJ('D'))(map.findIJ('A')); }
 
-		return getDistancesMap(map, from).at(to);
-	}
-
-	size_t getMaxDistanceFromArrival(const std::unordered_map<robot::Position, char>& map)
+	size_t getMaxDistanceFromArrival(const image::Image<char>& map)
 	{
-		const auto from      = std::find_if(map.begin(), map.end(), [](auto&& entry) { return entry.second == 'A'; })->first;
-		const auto distances = getDistancesMap(map, from);
+		const auto distances = getDistances(map, map.findIJ('A'));
 
 		size_t maxDistance = 0;
-		for (auto&& entry : map) {
-			if (entry.second == 'D' || entry.second == '.')
-				maxDistance = std::max(maxDistance, distances.at(entry.first));
+		for (const auto distance : distances) {
+			if (distance != std::numeric_limits<size_t>::max())
+				maxDistance = std::max(maxDistance, distance);
 		}
 		return maxDistance;
 	}
@@ -134,61 +179,7 @@ namespace {
 int main(int argc, char* argv[])
 {
 	const auto code = io::readLineOfIntegers("day15_input.txt");
-
-	auto position  = robot::Position{ 0, 0 };
-	auto direction = Direction::NORTH;
-	auto map       = std::unordered_map<robot::Position, char>{};
-	auto path      = std::vector<Direction>{};
-
-	map[position] = 'D';
-
-	const auto inputFunction = [&]() {
-		for (const auto nextDirection : getAllDirections()) {
-			const auto nextPosition = forwarded(position, nextDirection);
-			if (getValueAt(map, nextPosition) == ' ') {
-				direction = nextDirection;
-				return static_cast<std::int64_t>(direction);
-			}
-		}
-
-		if (path.empty())
-			throw EndException{};
-
-		direction = opposite(path.back());
-		return static_cast<std::int64_t>(direction);
-	};
-
-	const auto outputFunction = [&](const auto output) {
-		switch (output) {
-		case 0: {
-			map[forwarded(position, direction)] = '#';
-			break;
-		}
-		case 1: {
-			position = forwarded(position, direction);
-			if (path.empty() || path.back() != opposite(direction)) {
-				map[position] = '.';
-				path.push_back(direction);
-			}
-			else
-				path.pop_back();
-			break;
-		}
-		case 2: {
-			position      = forwarded(position, direction);
-			map[position] = 'A';
-			path.push_back(direction);
-			break;
-		}
-		default: throw std::exception{ "unsupported output" };
-		}
-	};
-
-	try {
-		opcode::run(code, inputFunction, outputFunction);
-	}
-	catch (const EndException&) {
-	}
+	const auto map  = explore(code);
 
 	std::cout << "Part 1: " << getNearestPathLength(map) << "\n";
 	std::cout << "Part 2: " << getMaxDistanceFromArrival(map) << "\n";
@@ -1,29 +1,24 @@
+#include "ascii.h"
 #include "image.h"
 #include "io.h"
 #include "opcode.h"
+#include "profile.h"
 #include "test.h"
 
 #include <boost/optional/optional.hpp>
+#include <fstream>
 #include <sstream>
 #include <unordered_set>
 
 namespace {
-	std::string toString(const std::vector<std::int64_t>& values)
+	std::string getCameraView(const std::vector<std::int64_t>& code)
 	{
-		auto result = std::string{};
-		result.reserve(values.size());
-		for (const auto value : values)
-			result.push_back(static_cast<char>(value));
-		return result;
-	}
-
-	std::vector<std::int64_t> toIntegers(const std::string& s)
-	{
-		auto result = std::vector<std::int64_t>{};
-		result.reserve(s.size());
-		for (const auto value : s)
-			result.push_back(static_cast<std::int64_t>(value));
-		return result;
+		auto view = std::string{};
+		opcode::run(code, opcode::AsciiIn{}, opcode::AsciiOut{ [&](boost::string_view line) {
+			view.append(line.data(), line.size());
+			view.push_back('\n');
+		} });
+		return view;
 	}
 
 	image::Image<char> toMap(const std::string& s)
@@ -227,7 +222,7 @@ namespace {
 
 	template<typename Function> void forEachPath(const std::vector<std::int64_t>& code, Function function)
 	{
-		const auto map         = toMap(toString(opcode::run(code)));
+		const auto map         = toMap(getCameraView(code));
 		const auto endPosition = getEndPosition(map);
 
 		auto stack = std::vector<CommandPath>{};
@@ -244,7 +239,8 @@ namespace {
 			// display(executedPath.map);
 
 			if (executedPath.position == endPosition) {
-				function(currentPath);
+				if (function(currentPath) == opcode::Control::Stop)
+					return;
 				continue;
 			}
 
@@ -356,42 +352,48 @@ namespace {
 		return boost::none;
 	}
 
-	struct FoundException : std::exception
-	{
-		FoundException(SplitCommand command) : command{ std::move(command) } {}
-		SplitCommand command;
-	};
-
 	void runPart1(const std::vector<std::int64_t>& code)
 	{
-		const auto map = toMap(toString(opcode::run(code)));
+		const auto map = toMap(getCameraView(code));
 		std::cout << "Part 1: " << getSumOfAlignments(map) << "\n";
 	}
 
-	void runPart2(std::vector<std::int64_t> code)
+	void runPart2(std::vector<std::int64_t> code, const opcode::Options& options = {})
 	{
-		try {
-			forEachPath(code, [](const CommandPath& path) {
-				const auto splitCommand = split(path);
-				if (splitCommand)
-					throw FoundException{ *splitCommand };
-			});
-		}
-		catch (const FoundException& e) {
+		auto splitCommand = boost::optional<SplitCommand>{};
+		forEachPath(code, [&](const CommandPath& path) {
+			splitCommand = split(path);
+			return splitCommand ? opcode::Control::Stop : opcode::Control::Continue;
+		});
+		if (!splitCommand)
+			throw std::exception{ "no path fits in three functions" };
 
-			code[0] = 2;
+		code[0] = 2;
 
-			const auto command = toString(e.command);
-			const auto inputs  = toIntegers(command);
-			const auto outputs = opcode::run(code, inputs);
-			std::cout << "Part 2: " << outputs.back() << "\n";
-		}
+		const auto command = toString(*splitCommand);
+
+		auto dust = std::int64_t{};
+		opcode::run(code, opcode::AsciiIn{ command }, opcode::AsciiOut{ nullptr, [&](std::int64_t value) { dust = value; } }, options);
+		std::cout << "Part 2: " << dust << "\n";
 	}
 }
 
 int main(int argc, char* argv[])
 {
 	const auto code = io::readLineOfIntegers("day17_input.txt");
+
+	if (argc > 1 && std::string{ argv[1] } == "--profile") {
+		auto profile    = opcode::Profile{};
+		auto options    = opcode::Options{};
+		options.backend = opcode::Backend::Interpreter;
+		options.profile = &profile;
+		runPart2(code, options);
+		opcode::writeReport(std::cout, profile);
+		std::ofstream out{ "day17.folded" };
+		opcode::writeFoldedStacks(out, profile);
+		return 0;
+	}
+
 	runPart1(code);
 	runPart2(code);
 	std::cin.get();
@@ -1,44 +1,43 @@
+#include "batch.h"
+#include "cache.h"
 #include "image.h"
 #include "io.h"
 #include "opcode.h"
 #include "test.h"
 #include <boost/optional.hpp>
+#include <chrono>
+#include <string>
 
 namespace {
-	int64_t getFieldAt(const std::vector<int64_t>& code, size_t i, size_t j)
+	int64_t getFieldAt(opcode::CachedRunner& runner, size_t i, size_t j)
 	{
-		return opcode::run(code, { static_cast<int64_t>(i), static_cast<int64_t>(j) }).back();
+		return runner.run({ static_cast<int64_t>(i), static_cast<int64_t>(j) }).back();
 	}
 
-	image::Image<int64_t> getField(const std::vector<int64_t>& code, size_t width, size_t height)
+	image::Image<int64_t> getField(const std::vector<int64_t>& code, size_t i0, size_t j0, size_t width, size_t height, const opcode::Options& options = {})
 	{
+		auto inputs = std::vector<std::vector<int64_t>>{};
+		for (size_t j = 0; j < height; ++j)
+			for (size_t i = 0; i < width; ++i)
+				inputs.push_back({ static_cast<int64_t>(i0 + i), static_cast<int64_t>(j0 + j) });
+
+		const auto outputs = opcode::runBatch(code, inputs, options);
+
 		auto field = image::Image<int64_t>{ width, height };
 		for (size_t j = 0; j < height; ++j)
 			for (size_t i = 0; i < width; ++i)
-				field(i, j) = getFieldAt(code, i, j);
+				field(i, j) = outputs[j * width + i].back();
 		return field;
 	}
 
-	bool isSquare(const std::vector<int64_t>& code, int64_t value, size_t i, size_t j, size_t size)
+	// The beam is a cone, so a square is inside it when its four corners are.
+	bool isSquare(opcode::CachedRunner& runner, int64_t value, size_t i, size_t j, size_t size)
 	{
-		if (getFieldAt(code, i, j) != value)
-			return false;
-		if (getFieldAt(code, i + size - 1, j) != value)
-			return false;
-		if (getFieldAt(code, i, j + size - 1) != value)
-			return false;
-		if (getFieldAt(code, i + size - 1, j + size - 1) != value)
-			return false;
-
-		for (size_t y = j; y < j + size; ++y)
-			for (size_t x = i; x < i + size; ++x)
-				if (getFieldAt(code, x, y) != value)
-					return false;
-
-		return true;
+		return getFieldAt(runner, i, j) == value && getFieldAt(runner, i + size - 1, j) == value && getFieldAt(runner, i, j + size - 1) == value
+		    && getFieldAt(runner, i + size - 1, j + size - 1) == value;
 	}
 
-	image::IJ findSquare(const std::vector<int64_t>& code, int64_t value, size_t size)
+	image::IJ findSquare(opcode::CachedRunner& runner, int64_t value, size_t size)
 	{
 		const size_t halfSize = size / 2;
 
@@ -48,14 +47,14 @@ namespace {
 		for (size_t ij = 1;; ++ij) {
 			for (size_t j = 1; j <= ij; ++j) {
 				const size_t i = ij - j;
-				if (isSquare(code, value, i * halfSize, j * halfSize, halfSize)) {
+				if (isSquare(runner, value, i * halfSize, j * halfSize, halfSize)) {
 
 					const size_t minX = (i - 1) * halfSize;
 					const size_t minY = (j - 1) * halfSize;
 
 					for (size_t y = minY; y < minY + size; ++y) {
 						for (size_t x = minX; x < minX + size; ++x) {
-							if (isSquare(code, value, x, y, size)) {
+							if (isSquare(runner, value, x, y, size)) {
 								if (x * x + y * y < minDistance) {
 									minDistance = x * x + y * y;
 									result      = image::IJ{ x, y };
@@ -70,17 +69,94 @@ namespace {
 		}
 		throw std::exception{ "not found" };
 	}
+
+	const char* getName(opcode::Backend backend)
+	{
+		switch (backend) {
+		case opcode::Backend::Interpreter: return "Interpreter";
+		case opcode::Backend::Decoded: return "Decoded";
+		case opcode::Backend::Threaded: return "Threaded";
+		case opcode::Backend::Jit: return "Jit";
+		default: throw std::exception{ "unsupported backend" };
+		}
+	}
+
+	// Probes the 50x50 field nRuns times and checks that the beam covers count50 points of it each time.
+	template<typename Probe> std::int64_t getProbesPerSecond(int nRuns, std::int64_t count50, Probe&& probe)
+	{
+		auto count = std::int64_t{};
+
+		const auto start = std::chrono::steady_clock::now();
+		for (int run = 0; run < nRuns; ++run)
+			for (int64_t j = 0; j < 50; ++j)
+				for (int64_t i = 0; i < 50; ++i)
+					count += probe(i, j);
+		const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		test::equals(count, nRuns * count50);
+		return static_cast<std::int64_t>(nRuns * 2500 / seconds);
+	}
+
+	void benchmark(const std::vector<int64_t>& code, std::int64_t count50)
+	{
+		for (const auto backend : { opcode::Backend::Interpreter, opcode::Backend::Decoded, opcode::Backend::Threaded, opcode::Backend::Jit }) {
+			auto options    = opcode::Options{};
+			options.backend = backend;
+			auto runner     = opcode::Runner{ code, options };
+
+			std::cout << getName(backend) << ": ";
+			std::cout << getProbesPerSecond(10, count50, [&](int64_t i, int64_t j) { return opcode::run(code, { i, j }, options).back(); }) << " probes/s (run), ";
+			std::cout << getProbesPerSecond(10, count50, [&](int64_t i, int64_t j) {
+				runner.reset();
+				runner.pushInputs({ i, j });
+				return runner.run().back();
+			}) << " probes/s (runner)\n";
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		for (int run = 0; run < 10; ++run) {
+			const auto field = getField(code, 0, 0, 50, 50);
+			test::equals(std::count(field.begin(), field.end(), 1), count50);
+		}
+		const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "Batch: " << static_cast<std::int64_t>(10 * 2500 / seconds) << " probes/s\n";
+	}
 }
 
 int main(int argc, char* argv[])
 {
-	const auto code    = io::readLineOfIntegers("day19_input.txt");
-	const auto field50 = getField(code, 50, 50);
+	const auto code = io::readLineOfIntegers("day19_input.txt");
+
+	// A probe takes a few hundred instructions; the budget keeps a bad one from hanging the search.
+	auto options   = opcode::Options{};
+	options.budget = 1 << 20;
+
+	opcode::CachedRunner runner{ code, size_t{ 1 } << 16, options };
+
+	const auto field50 = getField(code, 0, 0, 50, 50, options);
 	const auto count50 = std::count(field50.begin(), field50.end(), 1);
-	const auto pos100  = findSquare(code, 1, 100);
+	const auto pos100  = findSquare(runner, 1, 100);
+
+	for (size_t k = 0; k < 50; ++k)
+		test::equals(field50(k, 49 - k), getFieldAt(runner, k, 49 - k));
+
+	// A runner reset between probes gives the same field on every backend.
+	for (const auto backend : { opcode::Backend::Interpreter, opcode::Backend::Decoded, opcode::Backend::Threaded, opcode::Backend::Jit }) {
+		auto probeOptions    = opcode::Options{};
+		probeOptions.backend = backend;
+		auto probe           = opcode::Runner{ code, probeOptions };
+		for (size_t k = 0; k < 50; ++k) {
+			probe.reset();
+			probe.pushInputs({ static_cast<int64_t>(k), static_cast<int64_t>(49 - k) });
+			test::equals(probe.run().back(), field50(k, 49 - k));
+		}
+	}
 
 	std::cout << "Part 1: " << count50 << "\n";
 	std::cout << "Part 2: " << 10000 * pos100.i + pos100.j << "\n";
 
+	if (argc > 1 && std::string{ argv[1] } == "--benchmark")
+		benchmark(code, count50);
+
 	std::cin.get();
 }
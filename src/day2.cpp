@@ -1,5 +1,7 @@
+#include "batch.h"
 #include "io.h"
 #include "opcode.h"
+#include "sweep.h"
 #include "test.h"
 
 namespace {
@@ -17,24 +19,17 @@ namespace {
 		std::cout << "Part1: " << code.front() << "\n";
 	}
 
-	void runPart2(const std::vector<std::int64_t>& originalCode)
+	std::int64_t findNounVerb(const std::vector<std::int64_t>& code, std::int64_t target)
 	{
+		auto trials = std::vector<opcode::Trial>{};
+		for (std::int64_t noun = 0; noun <= 100; ++noun)
+			for (std::int64_t verb = 0; verb <= 100; ++verb)
+				trials.push_back({ { { 1, noun }, { 2, verb } }, {} });
 
-		for (int noun = 0; noun <= 100; ++noun) {
-			for (int verb = 0; verb <= 100; ++verb) {
-				auto code = originalCode;
-				code[1]   = noun;
-				code[2]   = verb;
-				try {
-					opcode::run(code);
-				}
-				catch (const std::exception&) {
-					continue;
-				}
-				if (code.front() == 19690720)
-					std::cout << "Part2: " << (100 * noun + verb) << "\n";
-			}
-		}
+		const auto match = opcode::sweep(code, trials, [&](const auto& memory, const auto&) { return memory.front() == target; });
+		if (!match)
+			throw std::exception{ "not found" };
+		return 100 * trials[*match].patches[0].second + trials[*match].patches[1].second;
 	}
 }
 
@@ -44,10 +39,38 @@ int main(int argc, char* argv[])
 	check({ 2, 3, 0, 3, 99 }, { 2, 3, 0, 6, 99 });
 	check({ 2, 4, 4, 5, 99, 0 }, { 2, 4, 4, 5, 99, 9801 });
 	check({ 1, 1, 1, 4, 99, 5, 6, 0, 99 }, { 30, 1, 1, 4, 2, 5, 6, 0, 99 });
+	test::equals(opcode::runBatch({ 3, 9, 8, 9, 10, 9, 4, 9, 99, -1, 8 }, { { 8 }, { 7 }, { 8 } }),
+	    std::vector<std::vector<std::int64_t>>{ { 1 }, { 0 }, { 1 } });
+	test::equals(opcode::runBatch({ 3, 100, 1001, 100, 0, 1099511627776, 4, 1099511627776, 99 }, { { 5 }, { 7 } }),
+	    std::vector<std::vector<std::int64_t>>{ { 5 }, { 7 } });
+
+	// The second lane loops forever, and only spends its own budget.
+	const auto looping = std::vector<std::int64_t>{ 3, 12, 1005, 12, 9, 104, 7, 99, 0, 1105, 1, 9, 0 };
+	auto       options = opcode::Options{};
+	options.budget     = 1000;
+	auto budgeted      = opcode::Batch{ looping, 2, options };
+	budgeted.pushInput(0, 0);
+	budgeted.pushInput(1, 1);
+	budgeted.run();
+	test::isTrue(budgeted.getStatus(0) == opcode::Status::Halted);
+	test::equals(budgeted.getOutputs(0), { 7 });
+	test::isTrue(budgeted.getStatus(1) == opcode::Status::Preempted);
+
+	opcode::StopSource stop;
+	stop.requestStop();
+	options.stop = &stop;
+	auto stopped = opcode::Batch{ looping, 2, options };
+	stopped.pushInput(0, 1);
+	stopped.pushInput(1, 1);
+	stopped.run();
+	test::isTrue(stopped.getStatus(0) == opcode::Status::Stopped && stopped.getStatus(1) == opcode::Status::Stopped);
+
+	test::equals(findNounVerb({ 1102, 0, 0, 0, 99 }, 121), 1111);
 
 	const auto code = io::readLineOfIntegers("day2_input.txt");
 	runPart1(code);
-	runPart2(code);
+
+	std::cout << "Part2: " << findNounVerb(code, 19690720) << "\n";
 
 	std::cin.get();
 }
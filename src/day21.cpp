@@ -1,37 +1,41 @@
+#include "ascii.h"
 #include "image.h"
 #include "io.h"
 #include "opcode.h"
 #include "test.h"
+#include <boost/optional.hpp>
 
 namespace {
-	std::vector<int64_t> convert(const std::string& s)
+	int64_t getDamage(opcode::Runner& runner, boost::string_view script)
 	{
-		auto result = std::vector<int64_t>{};
-		for (const char c : s)
-			result.push_back(c);
-		return result;
+		auto damage = boost::optional<int64_t>{};
+
+		runner.reset();
+		opcode::run(runner, opcode::AsciiIn{ script }, opcode::AsciiOut{ nullptr, [&](int64_t value) { damage = value; } });
+
+		if (!damage)
+			throw std::exception{ "the droid fell into space" };
+		return *damage;
 	}
 
-	void runPart1(const std::vector<int64_t>& code)
+	void runPart1(opcode::Runner& runner)
 	{
-		const auto inputs = convert("NOT A T\nNOT B J\nOR T J\nNOT C T\nOR T J\nAND D J\nWALK\n");
-		const auto output = opcode::run(code, inputs).back();
-		std::cout << "Part 1: " << output << "\n";
+		const auto damage = getDamage(runner, "NOT A T\nNOT B J\nOR T J\nNOT C T\nOR T J\nAND D J\nWALK\n");
+		std::cout << "Part 1: " << damage << "\n";
 	}
 
-	void runPart2(const std::vector<int64_t>& code)
+	void runPart2(opcode::Runner& runner)
 	{
-		const auto inputs = convert("NOT A T\nNOT B J\nOR T J\nNOT C T\nOR T J\nAND D J\nNOT E T\nNOT T T\nOR H T\nAND T J\nRUN\n");
-		const auto output = opcode::run(code, inputs).back();
-		std::cout << "Part 2: " << output << "\n";
+		const auto damage = getDamage(runner, "NOT A T\nNOT B J\nOR T J\nNOT C T\nOR T J\nAND D J\nNOT E T\nNOT T T\nOR H T\nAND T J\nRUN\n");
+		std::cout << "Part 2: " << damage << "\n";
 	}
 }
 
 int main(int argc, char* argv[])
 {
-	const auto code = io::readLineOfIntegers("day21_input.txt");
-	runPart1(code);
-	runPart2(code);
+	auto runner = opcode::Runner{ io::readLineOfIntegers("day21_input.txt") };
+	runPart1(runner);
+	runPart2(runner);
 
 	std::cin.get();
 }
@@ -1,48 +1,201 @@
+#include "ascii.h"
+#include "checkpoint.h"
 #include "io.h"
 #include "opcode.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <tbb/parallel_for.h>
+
+namespace {
+	enum class Weight : std::uint8_t
+	{
+		Unknown,
+		Light,
+		Heavy,
+		Right
+	};
+
+	std::string toScript(const std::vector<std::string>& lines)
+	{
+		auto script = std::string{};
+		for (const auto& line : lines) {
+			script += line;
+			script += '\n';
+		}
+		return script;
+	}
+
+	// Runs the machine until the script is used up, leaving it waiting for the next command.
+	void runScript(opcode::Machine& machine, boost::string_view script, opcode::AsciiOut& out, std::ostream* echo = nullptr)
+	{
+		auto in = opcode::AsciiIn{ script };
+		if (echo)
+			in.setEcho(*echo);
+
+		const auto input = [&](std::int64_t& value) {
+			if (!in.hasInput())
+				return opcode::Control::Stop;
+			value = in();
+			return opcode::Control::Continue;
+		};
+		opcode::run(machine, input, out);
+	}
+
+	std::vector<std::string> runCommand(opcode::Machine& machine, const std::string& command)
+	{
+		auto lines = std::vector<std::string>{};
+		auto out   = opcode::AsciiOut{ [&](boost::string_view line) { lines.push_back(line.to_string()); } };
+		runScript(machine, command + "\n", out);
+		out.flush();
+		return lines;
+	}
+
+	// Forks do not keep the profile, so runs on them are not profiled.
+	std::vector<std::string> getInventory(opcode::Machine& machine)
+	{
+		auto copy  = machine.fork();
+		auto items = std::vector<std::string>{};
+		for (const auto& line : runCommand(copy, "inv")) {
+			if (line.compare(0, 2, "- ") == 0)
+				items.push_back(line.substr(2));
+		}
+		return items;
+	}
+
+	Weight tryDoor(opcode::Machine& machine, const std::string& door)
+	{
+		const auto lines = runCommand(machine, door);
+		if (machine.getStatus() == opcode::Status::Halted)
+			return Weight::Right;
+
+		for (const auto& line : lines) {
+			if (line.find("heavier than the detected value") != std::string::npos)
+				return Weight::Light;
+			if (line.find("lighter than the detected value") != std::string::npos)
+				return Weight::Heavy;
+		}
+		throw std::exception{ "no weight check behind the door" };
+	}
+
+	// Finds which of the carried items let the droid through the door, as a mask over the items. Subsets are tried in Gray code order
+	// so that each trial takes or drops a single item, on machines started from the snapshot and spread over the TBB scheduler. A droid
+	// too light rules out every subset of its items, and one too heavy every superset.
+	std::uint32_t findItems(const opcode::Snapshot& snapshot, const std::vector<std::string>& items, const std::string& door)
+	{
+		const auto nSubsets = std::uint32_t{ 1 } << items.size();
+		const auto nChunks  = std::min(nSubsets, std::uint32_t{ 64 });
+
+		auto                       weights = std::vector<std::atomic<Weight>>(nSubsets);
+		std::atomic<std::uint32_t> found{ nSubsets };
+
+		tbb::parallel_for(std::uint32_t{ 0 }, nChunks, [&](std::uint32_t chunk) {
+			auto copy = opcode::Machine{ snapshot };
+			auto held = nSubsets - 1;
+
+			for (auto i = chunk * nSubsets / nChunks; i < (chunk + 1) * nSubsets / nChunks && found == nSubsets; ++i) {
+				const auto subset = i ^ (i >> 1);
+				for (size_t k = 0; k < items.size(); ++k) {
+					if (((held ^ subset) >> k) & 1)
+						runCommand(copy, ((subset >> k) & 1 ? "take " : "drop ") + items[k]);
+				}
+				held = subset;
+
+				if (weights[subset] != Weight::Unknown)
+					continue;
+
+				switch (tryDoor(copy, door)) {
+				case Weight::Right: found = subset; return;
+				case Weight::Light:
+					for (auto smaller = subset;; smaller = (smaller - 1) & subset) {
+						weights[smaller] = Weight::Light;
+						if (smaller == 0)
+							break;
+					}
+					break;
+				case Weight::Heavy:
+					for (auto larger = subset; larger < nSubsets; larger = (larger + 1) | subset)
+						weights[larger] = Weight::Heavy;
+					break;
+				default: break;
+				}
+			}
+		});
+
+		if (found == nSubsets)
+			throw std::exception{ "no set of items gets through the door" };
+		return found;
+	}
+}
 
 int main(int argc, char* argv[])
 {
-	const auto code  = io::readLineOfIntegers("day25_input.txt");
-	const auto items = std::vector<std::string>{ "prime number", "candy cane", "asterisk", "food ration", "boulder", "mutex", "mug", "loom" };
-	const auto mask  = 154;
+	const auto code = io::readLineOfIntegers("day25_input.txt");
+	const auto door = std::string{ "north" };
 
-	auto inputs = std::vector<std::string>{ "south", "west", "take asterisk", "east", "take boulder", "east", "take food ration", "west", "north",
+	// Picks up every safe item on the way to the security checkpoint, whose pressure plate is behind the door.
+	const auto walk = std::vector<std::string>{ "south", "west", "take asterisk", "east", "take boulder", "east", "take food ration", "west", "north",
 		"east", "take candy cane", "north", "east", "north", "take mug", "south", "west", "north", "take mutex", "north", "take prime number", "south", "south",
 		"south", "east", "north", "take loom", "south", "east", "south", "east", "east" };
 
-	for (auto i = 0; i < 8; ++i) {
-		if ((mask >> i) & 1)
-			inputs.push_back("drop " + items[i]);
-	}
-	inputs.emplace_back("inv");
-	inputs.emplace_back("north");
+	auto out = opcode::AsciiOut{ [](boost::string_view line) { std::cout << line << "\n"; } };
 
-	std::string input;
+	const auto hasFlag = [&](const std::string& flag) { return std::find(argv + 1, argv + argc, flag) != argv + argc; };
 
-	const auto inputFunction = [&]() {
-		if (input.empty()) {
-			if (!inputs.empty()) {
-				input = inputs.front();
-				inputs.erase(inputs.begin());
-				std::cout << input << "\n";
-			}
-			else {
-				std::getline(std::cin, input);
-			}
-			input += '\n';
+	const auto isProfiling    = hasFlag("--profile");
+	const auto useCheckpoint  = hasFlag("--checkpoint") && !isProfiling;
+	const auto checkpointPath = std::string{ "day25.checkpoint" };
+
+	auto profile = opcode::Profile{};
+	auto options = opcode::Options{};
+	if (isProfiling)
+		options.profile = &profile;
+
+	// With --checkpoint, the walk to the security checkpoint is run once and saved, then later runs start from the saved state as long
+	// as it was saved for the same program.
+	auto machine = opcode::Machine{ code, options };
+	auto resumed = false;
+	if (useCheckpoint && std::ifstream{ checkpointPath }.good()) {
+		try {
+			machine = opcode::loadCheckpoint(checkpointPath, code, options);
+			resumed = true;
+		}
+		catch (const std::exception& exception) {
+			std::cout << "Ignoring " << checkpointPath << ": " << exception.what() << "\n";
 		}
+	}
+	if (!resumed) {
+		runScript(machine, toScript(walk), out, &std::cout);
+		if (useCheckpoint)
+			opcode::saveCheckpoint(checkpointPath, code, machine);
+	}
 
-		const auto value = static_cast<int64_t>(input.front());
-		input.erase(0, 1);
-		return value;
-	};
+	const auto items = getInventory(machine);
+	const auto mask  = findItems(machine.snapshot(), items, door);
 
-	std::string output;
+	auto inputs = std::vector<std::string>{};
+	for (size_t k = 0; k < items.size(); ++k) {
+		if (!((mask >> k) & 1))
+			inputs.push_back("drop " + items[k]);
+	}
+	inputs.emplace_back("inv");
+	inputs.push_back(door);
 
-	const auto ouputFunction = [&](int64_t value) { std::cout << static_cast<char>(value); };
+	const auto script = toScript(inputs);
 
-	opcode::run(code, inputFunction, ouputFunction);
+	auto in = opcode::AsciiIn{ script, std::cin };
+	in.setEcho(std::cout);
+	opcode::run(machine, in, out);
+	out.flush();
+
+	if (isProfiling) {
+		opcode::writeReport(std::cout, profile);
+		std::ofstream out{ "day25.folded" };
+		opcode::writeFoldedStacks(out, profile);
+		return 0;
+	}
 
 	std::cin.get();
-}
+}
\ No newline at end of file
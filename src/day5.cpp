@@ -2,8 +2,43 @@
 #include "opcode.h"
 #include "test.h"
 
+#include <tbb/parallel_for.h>
+
 int main(int argc, char* argv[])
 {
+	auto echo = opcode::Machine{ { 3, 0, 4, 0, 99 } };
+	test::equals(echo.resume(), opcode::Status::NeedInput);
+	test::equals(echo.resume(), opcode::Status::NeedInput);
+	echo.pushInput(42);
+	test::equals(echo.resume(), opcode::Status::Output);
+	test::equals(echo.popOutput(), 42);
+	test::equals(echo.resume(), opcode::Status::Halted);
+
+	auto adder = opcode::Machine{ { 1101, 40, 2, 1099511627776, 3, 13, 1, 13, 1099511627776, 1099511627776, 4, 1099511627776, 99, 0 } };
+	test::equals(adder.resume(), opcode::Status::NeedInput);
+	const auto adderSnapshot = adder.snapshot();
+	auto       adderFork     = adder.fork();
+	adder.pushInput(1);
+	test::equals(adder.resume(), opcode::Status::Output);
+	test::equals(adder.popOutput(), 43);
+	adderFork.pushInput(2);
+	test::equals(adderFork.resume(), opcode::Status::Output);
+	test::equals(adderFork.popOutput(), 44);
+	auto adderRestored = opcode::Machine{ adderSnapshot };
+	adderRestored.pushInput(3);
+	test::equals(adderRestored.resume(), opcode::Status::Output);
+	test::equals(adderRestored.popOutput(), 45);
+
+	auto adderOutputs = std::vector<std::int64_t>(16);
+	tbb::parallel_for(size_t{ 0 }, adderOutputs.size(), [&](size_t k) {
+		auto machine = opcode::Machine{ adderSnapshot };
+		machine.pushInput(static_cast<std::int64_t>(k));
+		machine.resume();
+		adderOutputs[k] = machine.popOutput();
+	});
+	for (size_t k = 0; k < adderOutputs.size(); ++k)
+		test::equals(adderOutputs[k], static_cast<std::int64_t>(42 + k));
+
 	const auto codeEqual8PosMode = std::vector<std::int64_t>{ 3, 9, 8, 9, 10, 9, 4, 9, 99, -1, 8 };
 	test::equals(opcode::run(codeEqual8PosMode, { 7 }), { 0 });
 	test::equals(opcode::run(codeEqual8PosMode, { 8 }), { 1 });
@@ -1,17 +1,18 @@
+#include "channel.h"
 #include "io.h"
 #include "opcode.h"
+#include "phase.h"
 #include "test.h"
 
 #include <algorithm>
-#include <tbb/concurrent_queue.h>
-#include <tbb/task_group.h>
+#include <string>
 #include <thread>
 
 namespace {
 	class Amplifier
 	{
 	public:
-		Amplifier(std::string name, std::int64_t phase) : name_{ std::move(name) }, phase_{ phase }, bindedAmp_{ nullptr } {}
+		explicit Amplifier(std::int64_t phase) : phase_{ phase }, bindedAmp_{ nullptr } {}
 
 		~Amplifier()                = default;
 		Amplifier(const Amplifier&) = delete;
@@ -28,6 +29,8 @@ namespace {
 					phaseInitialized = true;
 					return phase_;
 				}
+				if (bindedAmp_)
+					bindedAmp_->inputs_.flush();
 				return getNextInput();
 			};
 
@@ -37,38 +40,35 @@ namespace {
 			};
 
 			opcode::run(code, inputFunction, outputFunction);
+			if (bindedAmp_)
+				bindedAmp_->inputs_.flush();
 		}
 
-		void addInput(std::int64_t input) { inputs_.push(input); }
+		void addInput(std::int64_t input)
+		{
+			inputs_.push(input);
+			inputs_.flush();
+		}
 
 		void bindTo(Amplifier& bindedAmp) { bindedAmp_ = &bindedAmp; }
 
-		std::int64_t getNextInput()
-		{
-			std::int64_t value;
-			while (!inputs_.try_pop(value))
-				std::this_thread::yield();
-			return value;
-		}
+		std::int64_t getNextInput() { return inputs_.pop(); }
 
 	private:
-		friend void bind(Amplifier& amp1, Amplifier& amp2);
-
-		std::string  name_;
 		std::int64_t phase_;
 
-		tbb::concurrent_queue<std::int64_t> inputs_;
+		opcode::Channel inputs_;
 
 		Amplifier* bindedAmp_;
 	};
 
 	std::int64_t getSignal(const std::vector<std::int64_t>& code, const std::vector<std::int64_t>& phaseSequence)
 	{
-		Amplifier A{ "A", phaseSequence[0] };
-		Amplifier B{ "B", phaseSequence[1] };
-		Amplifier C{ "C", phaseSequence[2] };
-		Amplifier D{ "D", phaseSequence[3] };
-		Amplifier E{ "E", phaseSequence[4] };
+		Amplifier A{ phaseSequence[0] };
+		Amplifier B{ phaseSequence[1] };
+		Amplifier C{ phaseSequence[2] };
+		Amplifier D{ phaseSequence[3] };
+		Amplifier E{ phaseSequence[4] };
 
 		A.addInput(0);
 		A.bindTo(B);
@@ -77,33 +77,36 @@ namespace {
 		D.bindTo(E);
 		E.bindTo(A);
 
-		tbb::task_group g;
-		g.run([&] { A.run(code); });
-		g.run([&] { B.run(code); });
-		g.run([&] { C.run(code); });
-		g.run([&] { D.run(code); });
-		g.run([&] { E.run(code); });
-		g.wait();
+		// Each amplifier blocks on the previous one, so they need a thread each: pool tasks would wait on tasks never scheduled.
+		std::thread a{ [&] { A.run(code); } };
+		std::thread b{ [&] { B.run(code); } };
+		std::thread c{ [&] { C.run(code); } };
+		std::thread d{ [&] { D.run(code); } };
+		std::thread e{ [&] { E.run(code); } };
+		for (auto* thread : { &a, &b, &c, &d, &e })
+			thread->join();
 
 		return A.getNextInput();
 	}
 
-	std::int64_t getMaxSignal(const std::vector<std::int64_t>& code, std::vector<std::int64_t> phaseSequence)
+	// Returns what the feedback chain throws when each amplifier may execute only budget instructions, or nothing if it gets the signal.
+	std::string getBudgetError(const std::vector<std::int64_t>& code, std::uint64_t budget)
 	{
-		std::sort(phaseSequence.begin(), phaseSequence.end());
-
-		std::int64_t maxSignal = 0;
-		do {
-			const auto signal = getSignal(code, phaseSequence);
-			if (signal > maxSignal)
-				maxSignal = signal;
-		} while (std::next_permutation(phaseSequence.begin(), phaseSequence.end()));
-
-		return maxSignal;
+		auto options   = opcode::Options{};
+		options.budget = budget;
+		auto chain     = opcode::AmplifierChain{ code, 5, options };
+		try {
+			chain.run({ 9, 8, 7, 6, 5 }, 0, true);
+			return {};
+		}
+		catch (const std::exception& exception) {
+			return exception.what();
+		}
 	}
 
-	std::int64_t getMaxSignal1(const std::vector<std::int64_t>& code) { return getMaxSignal(code, { 0, 1, 2, 3, 4 }); }
-	std::int64_t getMaxSignal2(const std::vector<std::int64_t>& code) { return getMaxSignal(code, { 5, 6, 7, 8, 9 }); }
+	std::int64_t getMaxSignal1(const std::vector<std::int64_t>& code) { return opcode::searchPhases(code, { 0, 1, 2, 3, 4 }, false).signal; }
+
+	std::int64_t getMaxSignal2(const std::vector<std::int64_t>& code) { return opcode::searchPhases(code, { 5, 6, 7, 8, 9 }, true).signal; }
 }
 
 int main(int argc, char* argv[])
@@ -120,6 +123,18 @@ int main(int argc, char* argv[])
 	                 1008, 54, 0, 55, 1001, 55, 1, 55, 2, 53, 55, 53, 4, 53, 1001, 56, -1, 56, 1005, 56, 6, 99, 0, 0, 0, 0, 10 }),
 	    18216);
 
+	test::equals(getSignal({ 3, 15, 3, 16, 1002, 16, 10, 16, 1, 16, 15, 15, 4, 15, 99, 0, 0 }, { 4, 3, 2, 1, 0 }), 43210);
+	test::equals(getSignal({ 3, 26, 1001, 26, -4, 26, 3, 27, 1002, 27, 2, 27, 1, 27, 26, 27, 4, 27, 1001, 28, -1, 28, 1005, 28, 6, 99, 0, 0, 5 }, { 9, 8, 7, 6, 5 }),
+	    139629729);
+	test::equals(getSignal({ 3, 52, 1001, 52, -5, 52, 3, 53, 1, 52, 56, 54, 1007, 54, 5, 55, 1005, 55, 26, 1001, 54, -5, 54, 1105, 1, 12, 1, 53, 54, 53, 1008,
+	                 54, 0, 55, 1001, 55, 1, 55, 2, 53, 55, 53, 4, 53, 1001, 56, -1, 56, 1005, 56, 6, 99, 0, 0, 0, 0, 10 },
+	                 { 9, 7, 8, 5, 6 }),
+	    18216);
+
+	const auto feedbackCode = std::vector<std::int64_t>{ 3, 26, 1001, 26, -4, 26, 3, 27, 1002, 27, 2, 27, 1, 27, 26, 27, 4, 27, 1001, 28, -1, 28, 1005, 28, 6, 99, 0, 0, 5 };
+	test::equals(getBudgetError(feedbackCode, 1000), std::string{});
+	test::equals(getBudgetError(feedbackCode, 10), std::string{ "instruction budget spent" });
+
 	const auto code = io::readLineOfIntegers("day7_input.txt");
 	std::cout << "Part 1: " << getMaxSignal1(code) << "\n";
 	std::cout << "Part 2: " << getMaxSignal2(code) << "\n";
@@ -1,17 +1,230 @@
+#include "cache.h"
+#include "cfg.h"
+#include "checkpoint.h"
 #include "io.h"
 #include "opcode.h"
 #include "test.h"
+#include "trace.h"
+
+#include <chrono>
+#include <sstream>
+
+namespace {
+	opcode::Options getOptions(opcode::Backend backend, opcode::Statistics* statistics = nullptr, opcode::TraceBuffer* trace = nullptr)
+	{
+		auto options       = opcode::Options{};
+		options.backend    = backend;
+		options.statistics = statistics;
+		options.trace      = trace;
+		return options;
+	}
+
+	const char* getName(opcode::Backend backend)
+	{
+		switch (backend) {
+		case opcode::Backend::Interpreter: return "Interpreter";
+		case opcode::Backend::Decoded: return "Decoded";
+		case opcode::Backend::Threaded: return "Threaded";
+		case opcode::Backend::Jit: return "Jit";
+		default: throw std::exception{ "unsupported backend" };
+		}
+	}
+
+	std::int64_t getInstructionsPerSecond(
+	    const std::vector<std::int64_t>& code, std::int64_t input, int nRuns, opcode::Backend backend, opcode::TraceBuffer* trace = nullptr)
+	{
+		auto statistics = opcode::Statistics{};
+
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < nRuns; ++i)
+			opcode::run(code, { input }, getOptions(backend, &statistics, trace));
+		const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		return static_cast<std::int64_t>(statistics.nInstructions / seconds);
+	}
+
+	// Echoes its inputs until it reads a negative one, so that nearly every instruction goes through an I/O policy.
+	template<typename Run> std::int64_t getValuesPerSecond(std::int64_t nValues, Run&& run)
+	{
+		const auto code = std::vector<std::int64_t>{ 3, 100, 1007, 100, 0, 101, 1005, 101, 14, 4, 100, 1105, 1, 0, 99 };
+
+		auto next = std::int64_t{};
+		auto sum  = std::int64_t{};
+
+		const auto start = std::chrono::steady_clock::now();
+		run(code, [&] { return next < nValues ? next++ : -1; }, [&](std::int64_t value) { sum += value; });
+		const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		test::equals(sum, nValues * (nValues - 1) / 2);
+		return static_cast<std::int64_t>(2 * nValues / seconds);
+	}
+
+	void benchmark(const std::vector<std::int64_t>& code)
+	{
+		const auto runPolicies  = [](const auto& code, auto in, auto out) { opcode::run(code, in, out); };
+		const auto runFunctions = [](const std::vector<std::int64_t>& code, std::function<std::int64_t()> in, std::function<void(std::int64_t)> out) {
+			opcode::run(code, std::move(in), std::move(out));
+		};
+		const auto runQueues = [](const std::vector<std::int64_t>& code, auto in, auto out) {
+			auto machine = opcode::Machine{ code };
+			for (;;) {
+				const auto status = machine.resume();
+				if (status == opcode::Status::NeedInput)
+					machine.pushInput(in());
+				else if (status == opcode::Status::Output)
+					out(machine.popOutput());
+				else
+					break;
+			}
+		};
+		std::cout << "I/O: " << getValuesPerSecond(1 << 22, runPolicies) << " values/s (policies), ";
+		std::cout << getValuesPerSecond(1 << 22, runFunctions) << " values/s (std::function), ";
+		std::cout << getValuesPerSecond(1 << 22, runQueues) << " values/s (resume)\n";
+
+		for (const auto backend : { opcode::Backend::Interpreter, opcode::Backend::Decoded, opcode::Backend::Threaded, opcode::Backend::Jit }) {
+			std::cout << getName(backend) << ": ";
+			std::cout << getInstructionsPerSecond(code, 1, 1000, backend) << " instructions/s (test mode), ";
+			std::cout << getInstructionsPerSecond(code, 2, 20, backend) << " instructions/s (sensor boost mode)\n";
+		}
+
+		opcode::TraceBuffer trace;
+		std::cout << "Traced: ";
+		std::cout << getInstructionsPerSecond(code, 1, 1000, opcode::Backend::Decoded, &trace) << " instructions/s (test mode), ";
+		std::cout << getInstructionsPerSecond(code, 2, 20, opcode::Backend::Decoded, &trace) << " instructions/s (sensor boost mode)\n";
+	}
+}
 
 int main(int argc, char* argv[])
 {
 	const auto codeQuine = std::vector<std::int64_t>{ 109, 1, 204, -1, 1001, 100, 1, 100, 1008, 100, 16, 101, 1006, 101, 0, 99 };
 	test::equals(opcode::run(codeQuine), codeQuine);
+	test::equals(opcode::run(codeQuine, {}, getOptions(opcode::Backend::Interpreter)), codeQuine);
+	test::equals(opcode::run(codeQuine, {}, getOptions(opcode::Backend::Threaded)), codeQuine);
+	test::equals(opcode::run(codeQuine, {}, getOptions(opcode::Backend::Jit)), codeQuine);
 	test::equals(opcode::run({ 1102, 34915192, 34915192, 7, 4, 7, 99, 0 }), { 1219070632396864 });
 	test::equals(opcode::run({ 104, 1125899906842624, 99 }), { 1125899906842624 });
+	test::equals(opcode::run({ 104, 0, 1001, 1, 1, 1, 1007, 1, 3, 20, 1005, 20, 0, 99 }), { 0, 1, 2 });
+	test::equals(opcode::run({ 104, 0, 1001, 1, 1, 1, 1007, 1, 3, 20, 1005, 20, 0, 99 }, {}, getOptions(opcode::Backend::Threaded)), { 0, 1, 2 });
+	test::equals(opcode::run({ 104, 0, 1001, 1, 1, 1, 1007, 1, 3, 20, 1005, 20, 0, 99 }, {}, getOptions(opcode::Backend::Jit)), { 0, 1, 2 });
+	test::equals(opcode::run({ 1101, 40, 2, 6, 1101, 0, 0, 20, 4, 20, 99 }, {}, getOptions(opcode::Backend::Jit)), { 42 });
+	test::equals(opcode::run({ 1101, 7, 0, 1099511627776, 4, 1099511627776, 99 }), { 7 });
+	test::equals(opcode::run({ 1101, 7, 0, 1099511627776, 4, 1099511627776, 99 }, {}, getOptions(opcode::Backend::Interpreter)), { 7 });
+	test::equals(opcode::run({ 109, 1099511627776, 21101, 5, 6, 0, 204, 0, 4, 1099511627777, 99 }), { 11, 0 });
+	test::equals(opcode::run({ 109, 1099511627776, 21101, 5, 6, 0, 204, 0, 4, 1099511627777, 99 }, {}, getOptions(opcode::Backend::Jit)), { 11, 0 });
+	test::equals(opcode::run({ 1101, 1, 2, 11, 1105, 1, 8, 99, 4, 11, 99, 0 }), { 3 });
+	test::equals(opcode::run({ 1108, 5, 6, 5, 1005, 5, 10, 104, 7, 99, 104, 9, 99 }), { 9 });
+	test::equals(opcode::run({ 1108, 5, 6, 5, 1005, 5, 10, 104, 7, 99, 104, 9, 99 }, {}, getOptions(opcode::Backend::Threaded)), { 9 });
+
+	opcode::TraceBuffer trace{ 2 };
+	test::equals(opcode::run({ 1101, 1, 2, 11, 1105, 1, 8, 99, 4, 11, 99, 0 }, {}, getOptions(opcode::Backend::Decoded, nullptr, &trace)), { 3 });
+	test::equals(trace.getNRecords(), std::uint64_t{ 3 });
+	std::stringstream traceStream;
+	opcode::writeTrace(traceStream, trace);
+	const auto records = opcode::readTrace(traceStream);
+	test::equals(records.size(), size_t{ 2 });
+	test::equals(records[0].position, std::int64_t{ 4 });
+	test::equals(records[0].value, std::int64_t{ 8 });
+	test::equals(records[1].opCode, std::int64_t{ 4 });
+	test::equals(records[1].value, std::int64_t{ 3 });
+
+	opcode::StopSource stop;
+	stop.requestStop();
+	for (const auto backend : { opcode::Backend::Interpreter, opcode::Backend::Decoded, opcode::Backend::Threaded, opcode::Backend::Jit }) {
+		auto options = getOptions(backend);
+		options.stop = &stop;
+		auto machine = opcode::Machine{ { 1105, 1, 0 }, options };
+		test::isTrue(machine.resume() == opcode::Status::Stopped);
+	}
+
+	auto stopped = opcode::Options{};
+	stopped.stop = &stop;
+	opcode::CachedRunner cached{ { 1105, 1, 0 }, 16, stopped };
+	for (auto i = 0; i < 2; ++i) {
+		auto isStopped = false;
+		try {
+			cached.run({});
+		}
+		catch (const std::exception&) {
+			isStopped = true;
+		}
+		test::isTrue(isStopped);
+	}
+	test::equals(cached.getNHits(), std::uint64_t{ 0 });
+
+	auto machine = opcode::Machine{ { 1001, 9, 1, 9, 1105, 1, 0, 99, 0, 0 } };
+	test::isTrue(machine.resume(3) == opcode::Status::Preempted);
+	test::equals(machine.getNInstructions(), std::uint64_t{ 3 });
+	test::isTrue(machine.resume(1000) == opcode::Status::Preempted);
+	test::equals(machine.getNInstructions(), std::uint64_t{ 1003 });
+
+	// Compiled code rewrites the output below, which the budgeted runs execute decoded.
+	auto rewritten = opcode::Machine{ { 3, 100, 1005, 100, 10, 104, 7, 1105, 1, 0, 1101, 0, 8, 6, 1105, 1, 0 }, getOptions(opcode::Backend::Jit) };
+	rewritten.pushInput(0);
+	test::isTrue(rewritten.resume(1000) == opcode::Status::Output);
+	test::equals(rewritten.popOutput(), 7);
+	test::isTrue(rewritten.resume(1000) == opcode::Status::NeedInput);
+	rewritten.pushInput(1);
+	test::isTrue(rewritten.resume() == opcode::Status::NeedInput);
+	rewritten.pushInput(0);
+	test::isTrue(rewritten.resume(1000) == opcode::Status::Output);
+	test::equals(rewritten.popOutput(), 8);
+
+	auto budgeted   = opcode::Options{};
+	budgeted.budget = 1000;
+	auto isSpent    = false;
+	try {
+		opcode::run({ 1105, 1, 0 }, {}, budgeted);
+	}
+	catch (const std::exception&) {
+		isSpent = true;
+	}
+	test::isTrue(isSpent);
+
+	auto paused = opcode::Machine{ codeQuine };
+	auto quine  = std::vector<std::int64_t>{};
+	while (quine.size() < 5 && paused.resume() == opcode::Status::Output)
+		quine.push_back(paused.popOutput());
+	auto checkpoint = std::stringstream{};
+	opcode::writeCheckpoint(checkpoint, codeQuine, paused);
+	const auto saved    = checkpoint.str();
+	auto       restored = opcode::readCheckpoint(checkpoint, codeQuine);
+	test::equals(restored.getNInstructions(), paused.getNInstructions());
+	opcode::run(restored, [] { return std::int64_t{}; }, [&](std::int64_t value) { quine.push_back(value); });
+	test::equals(quine, codeQuine);
+
+	const auto isRejected = [](const std::string& bytes, const std::vector<std::int64_t>& code) {
+		auto in = std::stringstream{ bytes };
+		try {
+			opcode::readCheckpoint(in, code);
+		}
+		catch (const std::exception&) {
+			return true;
+		}
+		return false;
+	};
+	auto oversized = saved;
+	oversized[23]  = '\x7f';
+	test::isTrue(isRejected(saved, { 99 }));
+	test::isTrue(isRejected(oversized, codeQuine));
+
+	auto nOutputs = 0;
+	test::isTrue(opcode::run(codeQuine, [] { return std::int64_t{}; }, [&](std::int64_t) { return ++nOutputs == 3 ? opcode::Control::Stop : opcode::Control::Continue; })
+	    == opcode::Status::Stopped);
+	test::equals(nOutputs, 3);
+
+	const auto cfg = opcode::ControlFlowGraph{ { 104, 0, 1001, 1, 1, 1, 1007, 1, 3, 20, 1005, 20, 0, 99 } };
+	test::equals(cfg.getBlocks().size(), size_t{ 2 });
+	test::equals(cfg.getBlocks()[0].successors, { 0, 13 });
+	test::equals(cfg.findOpcodePairs().size(), size_t{ 3 });
 
 	const auto code = io::readLineOfIntegers("day9_input.txt");
 	std::cout << "Part 1: " << io::toString(opcode::run(code, { 1 })) << "\n";
 	std::cout << "Part 2: " << io::toString(opcode::run(code, { 2 })) << "\n";
+	test::equals(opcode::run(code, { 1 }, getOptions(opcode::Backend::Jit)), opcode::run(code, { 1 }));
+	test::equals(opcode::run(code, { 2 }, getOptions(opcode::Backend::Jit)), opcode::run(code, { 2 }));
+
+	if (argc > 1 && std::string{ argv[1] } == "--benchmark")
+		benchmark(code);
 
 	std::cin.get();
 }
@@ -0,0 +1,30 @@
+#include "aot.h"
+#include "io.h"
+#include "opcode.h"
+#include "test.h"
+
+#include <chrono>
+
+namespace {
+	double getSeconds(const std::function<void()>& function)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		function();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	const auto code = io::readLineOfIntegers("day9_input.txt");
+	test::equals(opcode::aot::run({ 1 }), opcode::run(code, { 1 }));
+	test::equals(opcode::aot::run({ 2 }), opcode::run(code, { 2 }));
+
+	std::cout << "Part 1: " << io::toString(opcode::aot::run({ 1 })) << "\n";
+	std::cout << "Part 2: " << io::toString(opcode::aot::run({ 2 })) << "\n";
+
+	std::cout << "Decoded: " << getSeconds([&]() { opcode::run(code, { 2 }); }) * 1000 << " ms (sensor boost mode)\n";
+	std::cout << "AOT: " << getSeconds([]() { opcode::aot::run({ 2 }); }) * 1000 << " ms (sensor boost mode)\n";
+
+	std::cin.get();
+}
\ No newline at end of file
@@ -0,0 +1,176 @@
+#include "cfg.h"
+#include "io.h"
+#include "pmode.h"
+
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+
+namespace {
+	using namespace opcode::detail;
+
+	class Generator
+	{
+	public:
+		explicit Generator(std::vector<std::int64_t> image) : image_{ std::move(image) }, cfg_{ image_ } {}
+
+		std::string generate(const std::string& inputName) const
+		{
+			auto code = std::vector<std::uint8_t>(image_.size(), 0);
+			for (size_t i = 0; i < image_.size(); ++i)
+				code[i] = cfg_.isCode(static_cast<std::int64_t>(i)) ? 1 : 0;
+
+			auto out = std::ostringstream{};
+			out << "// Generated by IntcodeAOT from " << inputName << ", do not edit.\n";
+			out << "#include \"aot.h\"\n\n";
+			out << "namespace {\n";
+			out << "\tconst auto image = std::vector<std::int64_t>{";
+			writeList(out, image_);
+			out << "};\n\n";
+			out << "\tconst auto code = std::vector<std::uint8_t>{";
+			writeList(out, code);
+			out << "};\n";
+			out << "}\n\n";
+			out << "namespace opcode {\n";
+			out << "\tnamespace aot {\n";
+			out << "\t\tvoid run(std::function<std::int64_t()> inputFunction, std::function<void(std::int64_t)> outputFunction)\n";
+			out << "\t\t{\n";
+			out << "\t\t\tauto s = State{ image, code, std::move(inputFunction), std::move(outputFunction) };\n";
+			jump(out, 0, "\t\t\t");
+			for (const auto& block : cfg_.getBlocks())
+				generateBlock(out, block);
+			out << "\t\t}\n";
+			out << "\t}\n";
+			out << "}\n";
+			return out.str();
+		}
+
+	private:
+		std::string read(std::int64_t arg, int pMode) const
+		{
+			switch (pMode) {
+			case Position: return "s.read(" + toLiteral(arg) + ")";
+			case Immediate: return toLiteral(arg);
+			default: return "s.read(s.relativeBase + " + toLiteral(arg) + ")";
+			}
+		}
+
+		void write(std::ostream& out, std::int64_t arg, int pMode, const std::string& value, std::int64_t next, std::int64_t end) const
+		{
+			if (pMode == Position && !cfg_.isCode(arg))
+				out << "\t\t\ts.write(" << toLiteral(arg) << ", " << value << ");\n";
+			else {
+				const auto address = pMode == Position ? toLiteral(arg) : "s.relativeBase + " + toLiteral(arg);
+				out << "\t\t\tif (s.writeCode(" << address << ", " << value << ") && s.isModified(" << next << ", " << end << "))\n";
+				out << "\t\t\t\treturn s.fallback(" << next << ");\n";
+			}
+		}
+
+		void jump(std::ostream& out, std::int64_t target, const std::string& indent) const
+		{
+			if (cfg_.isBlockStart(target))
+				out << indent << "goto block" << target << ";\n";
+			else
+				out << indent << "return s.fallback(" << target << ");\n";
+		}
+
+		void jump(std::ostream& out, const std::string& target, const std::string& indent) const
+		{
+			out << indent << "const auto target = " << target << ";\n";
+			out << indent << "switch (target) {\n";
+			for (const auto& block : cfg_.getBlocks())
+				out << indent << "case " << block.start << ": goto block" << block.start << ";\n";
+			out << indent << "default: return s.fallback(target);\n";
+			out << indent << "}\n";
+		}
+
+		void generateBlock(std::ostream& out, const opcode::BasicBlock& block) const
+		{
+			const auto start = block.start;
+			const auto end   = block.end;
+			out << "\n\t\tblock" << start << ":\n";
+			out << "\t\t\tif (s.isModified(" << start << ", " << end << "))\n";
+			out << "\t\t\t\treturn s.fallback(" << start << ");\n";
+
+			auto instruction = opcode::DecodedInstruction{};
+			for (auto position = start; position < end; position += instruction.nArgs + 1) {
+				opcode::decodeInstruction(image_, position, instruction);
+
+				const auto* args = &image_[position + 1];
+				const auto  next = position + instruction.nArgs + 1;
+				const auto  a    = instruction.nArgs > 0 ? read(args[0], instruction.pModes[0]) : "";
+				const auto  b    = instruction.nArgs > 1 ? read(args[1], instruction.pModes[1]) : "";
+
+				switch (instruction.op) {
+				case 1: write(out, args[2], instruction.pModes[2], a + " + " + b, next, end); break;
+				case 2: write(out, args[2], instruction.pModes[2], a + " * " + b, next, end); break;
+				case 3: write(out, args[0], instruction.pModes[0], "s.input()", next, end); break;
+				case 4: out << "\t\t\ts.output(" << a << ");\n"; break;
+				case 5:
+				case 6:
+					out << "\t\t\tif (" << a << (instruction.op == 5 ? " != 0" : " == 0") << ") {\n";
+					if (instruction.pModes[1] == Immediate)
+						jump(out, args[1], "\t\t\t\t");
+					else
+						jump(out, b, "\t\t\t\t");
+					out << "\t\t\t}\n";
+					break;
+				case 7: write(out, args[2], instruction.pModes[2], "(" + a + " < " + b + " ? 1 : 0)", next, end); break;
+				case 8: write(out, args[2], instruction.pModes[2], "(" + a + " == " + b + " ? 1 : 0)", next, end); break;
+				case 9: out << "\t\t\ts.relativeBase += " << a << ";\n"; break;
+				default: out << "\t\t\treturn;\n"; return;
+				}
+			}
+			jump(out, end, "\t\t\t");
+		}
+
+		static std::string toLiteral(std::int64_t value) { return value == std::numeric_limits<std::int64_t>::min() ? "INT64_MIN" : std::to_string(value) + "LL"; }
+
+		template<typename T> static void writeList(std::ostream& out, const std::vector<T>& values)
+		{
+			for (size_t i = 0; i < values.size(); ++i)
+				out << (i % 20 == 0 ? "\n\t\t" : " ") << static_cast<std::int64_t>(values[i]) << (i + 1 < values.size() ? "," : "\n\t");
+		}
+
+		std::vector<std::int64_t> image_;
+		opcode::ControlFlowGraph  cfg_;
+	};
+}
+
+int main(int argc, char* argv[])
+{
+	const auto pairs = argc == 3 && std::string{ argv[1] } == "--pairs";
+	if (argc != 3) {
+		std::cerr << "usage: IntcodeAOT <input file> <output file>\n";
+		std::cerr << "       IntcodeAOT --pairs <input file>\n";
+		return 1;
+	}
+
+	const auto* inputName = pairs ? argv[2] : argv[1];
+	if (!std::ifstream{ inputName }) {
+		std::cerr << "cannot open " << inputName << "\n";
+		return 1;
+	}
+
+	const auto lines = io::readLinesOfStrings(inputName, ",", true);
+	if (lines.empty()) {
+		std::cerr << "cannot read " << inputName << "\n";
+		return 1;
+	}
+
+	auto image = std::vector<std::int64_t>{};
+	for (const auto& value : lines.front())
+		image.push_back(std::stoll(value));
+
+	// Lists how often each instruction follows another inside a basic block, to pick the next superinstructions to fuse.
+	if (pairs) {
+		for (const auto& pair : opcode::ControlFlowGraph{ std::move(image) }.findOpcodePairs())
+			std::cout << pair.first << " " << pair.second << " " << pair.count << "\n";
+		return 0;
+	}
+
+	auto out = std::ofstream{ argv[2] };
+	out << Generator{ std::move(image) }.generate(inputName);
+	return out ? 0 : 1;
+}
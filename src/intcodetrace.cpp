@@ -0,0 +1,27 @@
+#include "trace.h"
+
+#include <fstream>
+#include <iostream>
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2) {
+		std::cerr << "usage: IntcodeTrace <trace file>\n";
+		return 1;
+	}
+
+	auto in = std::ifstream{ argv[1], std::ios::binary };
+	if (!in) {
+		std::cerr << "cannot open " << argv[1] << "\n";
+		return 1;
+	}
+
+	try {
+		opcode::writeTraceText(std::cout, opcode::readTrace(in));
+	}
+	catch (const std::exception& e) {
+		std::cerr << argv[1] << ": " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,735 @@
+#include "jit.h"
+#include "memory.h"
+#include "pmode.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define OPCODE_JIT
+#endif
+
+#if defined(OPCODE_JIT) && defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(OPCODE_JIT)
+#include <sys/mman.h>
+#endif
+
+namespace opcode {
+	namespace {
+		constexpr size_t       bufferSize          = 1 << 20;
+		constexpr size_t       maxInstructionBytes = 1024;
+		constexpr std::int64_t maxBlockSize        = 32;
+		constexpr std::int64_t maxBlockSpan        = maxBlockSize * 4;
+
+		using namespace detail;
+
+		enum Register { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+
+		enum Condition { AboveOrEqual = 0x3, Equal = 0x4, NotEqual = 0x5, Less = 0xc };
+
+#if defined(_WIN32)
+		constexpr Register argument1 = rcx, argument2 = rdx, argument3 = r8;
+#else
+		constexpr Register argument1 = rdi, argument2 = rsi, argument3 = rdx;
+#endif
+
+		// Six saved registers and the return address leave the frame 16-byte aligned for calls. The spill slot is above the 32 bytes
+		// that Windows calls may use.
+		constexpr std::int32_t frameSize   = 40;
+		constexpr std::int32_t spillOffset = 32;
+
+		constexpr std::int32_t imageOffset         = offsetof(Jit::Context, image);
+		constexpr std::int32_t imageSizeOffset     = offsetof(Jit::Context, imageSize);
+		constexpr std::int32_t coverageOffset      = offsetof(Jit::Context, coverage);
+		constexpr std::int32_t bodiesOffset        = offsetof(Jit::Context, bodies);
+		constexpr std::int32_t relativeBaseOffset  = offsetof(Jit::Context, relativeBase);
+		constexpr std::int32_t nInstructionsOffset = offsetof(Jit::Context, nInstructions);
+		constexpr std::int32_t pageIndexOffset     = offsetof(Jit::Context, pageIndex);
+		constexpr std::int32_t pageOffset          = offsetof(Jit::Context, page);
+		constexpr std::int32_t bailOffset          = offsetof(Jit::Context, bail);
+		constexpr std::int32_t readOffset          = offsetof(Jit::Context, read);
+		constexpr std::int32_t writeOffset         = offsetof(Jit::Context, write);
+
+		bool fitsInt32(std::int64_t value) { return value >= std::numeric_limits<std::int32_t>::min() && value <= std::numeric_limits<std::int32_t>::max(); }
+
+		class Assembler
+		{
+		public:
+			explicit Assembler(std::uint8_t* code) : code_{ code } {}
+
+			size_t getSize() const { return size_; }
+
+			void push(Register r)
+			{
+				rex(false, 0, 0, r);
+				byte(0x50 | (r & 7));
+			}
+
+			void pop(Register r)
+			{
+				rex(false, 0, 0, r);
+				byte(0x58 | (r & 7));
+			}
+
+			void ret() { byte(0xc3); }
+
+			void addRsp(std::int8_t value)
+			{
+				rex(true, 0, 0, rsp);
+				byte(0x83);
+				byte(0xc4);
+				byte(static_cast<std::uint8_t>(value));
+			}
+
+			void subRsp(std::int8_t value)
+			{
+				rex(true, 0, 0, rsp);
+				byte(0x83);
+				byte(0xec);
+				byte(static_cast<std::uint8_t>(value));
+			}
+
+			void mov(Register dst, Register src)
+			{
+				if (dst != src)
+					arithmetic(0x89, dst, src);
+			}
+
+			void mov(Register dst, std::int64_t value)
+			{
+				rex(true, 0, 0, dst);
+				if (fitsInt32(value)) {
+					byte(0xc7);
+					byte(0xc0 | (dst & 7));
+					int32(static_cast<std::int32_t>(value));
+				}
+				else {
+					byte(0xb8 | (dst & 7));
+					int64(value);
+				}
+			}
+
+			void load(Register dst, Register base, std::int32_t disp)
+			{
+				rex(true, dst, 0, base);
+				byte(0x8b);
+				memory(dst, base, disp);
+			}
+
+			void store(Register base, std::int32_t disp, Register src)
+			{
+				rex(true, src, 0, base);
+				byte(0x89);
+				memory(src, base, disp);
+			}
+
+			void loadIndexed(Register dst, Register base, Register index)
+			{
+				rex(true, dst, index, base);
+				byte(0x8b);
+				memory(dst, base, index, 3);
+			}
+
+			void storeIndexed(Register base, Register index, Register src)
+			{
+				rex(true, src, index, base);
+				byte(0x89);
+				memory(src, base, index, 3);
+			}
+
+			void lea(Register dst, Register base, std::int32_t disp)
+			{
+				rex(true, dst, 0, base);
+				byte(0x8d);
+				memory(dst, base, disp);
+			}
+
+			void add(Register dst, std::int32_t value)
+			{
+				rex(true, 0, 0, dst);
+				byte(0x81);
+				byte(0xc0 | (dst & 7));
+				int32(value);
+			}
+
+			void andMask(Register dst, std::int32_t value)
+			{
+				rex(true, 0, 0, dst);
+				byte(0x81);
+				byte(0xe0 | (dst & 7));
+				int32(value);
+			}
+
+			void shr(Register dst, std::uint8_t count)
+			{
+				rex(true, 0, 0, dst);
+				byte(0xc1);
+				byte(0xe8 | (dst & 7));
+				byte(count);
+			}
+
+			void cmp(Register dst, Register base, std::int32_t disp)
+			{
+				rex(true, dst, 0, base);
+				byte(0x3b);
+				memory(dst, base, disp);
+			}
+
+			void add(Register dst, Register src) { arithmetic(0x01, dst, src); }
+			void cmp(Register dst, Register src) { arithmetic(0x39, dst, src); }
+			void test(Register dst, Register src) { arithmetic(0x85, dst, src); }
+
+			void imul(Register dst, Register src)
+			{
+				rex(true, dst, 0, src);
+				byte(0x0f);
+				byte(0xaf);
+				byte(0xc0 | (dst & 7) << 3 | (src & 7));
+			}
+
+			void cmpByteZero(Register base, std::int32_t disp)
+			{
+				rex(false, 0, 0, base);
+				byte(0x80);
+				memory(7, base, disp);
+				byte(0);
+			}
+
+			void cmpByteZero(Register base, Register index)
+			{
+				rex(false, 0, index, base);
+				byte(0x80);
+				memory(7, base, index, 0);
+				byte(0);
+			}
+
+			void testAl()
+			{
+				byte(0x84);
+				byte(0xc0);
+			}
+
+			void setRax(Condition condition)
+			{
+				byte(0x0f);
+				byte(0x90 | condition);
+				byte(0xc0);
+				byte(0x0f);
+				byte(0xb6);
+				byte(0xc0);
+			}
+
+			void call(Register base, std::int32_t disp)
+			{
+				rex(false, 0, 0, base);
+				byte(0xff);
+				memory(2, base, disp);
+			}
+
+			size_t jump(Condition condition)
+			{
+				byte(0x0f);
+				byte(0x80 | condition);
+				int32(0);
+				return size_;
+			}
+
+			size_t jump()
+			{
+				byte(0xe9);
+				int32(0);
+				return size_;
+			}
+
+			void jump(Register target)
+			{
+				rex(false, 0, 0, target);
+				byte(0xff);
+				byte(0xe0 | (target & 7));
+			}
+
+			void bind(size_t label)
+			{
+				const auto offset = static_cast<std::int32_t>(size_ - label);
+				std::copy_n(reinterpret_cast<const std::uint8_t*>(&offset), sizeof(offset), code_ + label - sizeof(offset));
+			}
+
+		private:
+			void byte(std::uint8_t value) { code_[size_++] = value; }
+
+			void int32(std::int32_t value)
+			{
+				std::copy_n(reinterpret_cast<const std::uint8_t*>(&value), sizeof(value), code_ + size_);
+				size_ += sizeof(value);
+			}
+
+			void int64(std::int64_t value)
+			{
+				std::copy_n(reinterpret_cast<const std::uint8_t*>(&value), sizeof(value), code_ + size_);
+				size_ += sizeof(value);
+			}
+
+			void rex(bool wide, int reg, int index, int base)
+			{
+				const auto value = 0x40 | (wide ? 8 : 0) | (reg >> 3) << 2 | (index >> 3) << 1 | base >> 3;
+				if (value != 0x40)
+					byte(static_cast<std::uint8_t>(value));
+			}
+
+			void arithmetic(std::uint8_t opCode, Register dst, Register src)
+			{
+				rex(true, src, 0, dst);
+				byte(opCode);
+				byte(0xc0 | (src & 7) << 3 | (dst & 7));
+			}
+
+			void memory(int reg, Register base, std::int32_t disp)
+			{
+				byte(0x80 | (reg & 7) << 3 | (base & 7));
+				if ((base & 7) == rsp)
+					byte(0x24);
+				int32(disp);
+			}
+
+			void memory(int reg, Register base, Register index, int scale)
+			{
+				byte(0x04 | (reg & 7) << 3);
+				byte(scale << 6 | (index & 7) << 3 | (base & 7));
+			}
+
+			std::uint8_t* code_;
+			size_t        size_ = 0;
+		};
+
+		class Compiler
+		{
+		public:
+			Compiler(std::uint8_t* code, const std::int64_t* image, std::int64_t imageSize) : assembler_{ code }, image_{ image }, imageSize_{ imageSize } {}
+
+			size_t getSize() const { return assembler_.getSize(); }
+
+			// The image, its size, the relative base, the context, the coverage and the instruction count stay in callee-saved registers
+			// for as long as blocks chain into each other, and are written back to the context only on the way out.
+			void prologue()
+			{
+				for (const auto r : { rbx, rbp, r12, r13, r14, r15 })
+					assembler_.push(r);
+				assembler_.subRsp(frameSize);
+				assembler_.mov(r14, argument1);
+				assembler_.load(rbx, r14, imageOffset);
+				assembler_.load(r12, r14, imageSizeOffset);
+				assembler_.load(r13, r14, relativeBaseOffset);
+				assembler_.load(r15, r14, coverageOffset);
+				assembler_.load(rbp, r14, nInstructionsOffset);
+			}
+
+			bool instruction(std::int64_t position, std::int64_t count)
+			{
+				const auto value = image_[position];
+				if (value < 0)
+					return false;
+
+				const auto op     = static_cast<int>(value % 100);
+				const auto pMode1 = static_cast<int>(value / 100 % 10);
+				const auto pMode2 = static_cast<int>(value / 1000 % 10);
+				const auto pMode3 = static_cast<int>(value / 10000 % 10);
+
+				auto nArgs = 0;
+				switch (op) {
+				case 1:
+				case 2:
+				case 7:
+				case 8: nArgs = pMode1 <= Relative && pMode2 <= Relative && (pMode3 == Position || pMode3 == Relative) ? 3 : 0; break;
+				case 5:
+				case 6: nArgs = pMode1 <= Relative && pMode2 <= Relative ? 2 : 0; break;
+				case 9: nArgs = pMode1 <= Relative ? 1 : 0; break;
+				default: break;
+				}
+
+				if (nArgs == 0 || position + nArgs >= imageSize_)
+					return false;
+
+				position_ = position;
+				count_    = count;
+
+				const auto* args = image_ + position + 1;
+				switch (op) {
+				case 9:
+					loadOperand(rax, args[0], pMode1);
+					assembler_.add(r13, rax);
+					break;
+				case 5:
+				case 6: {
+					loadOperand(rax, args[0], pMode1);
+					assembler_.test(rax, rax);
+					const auto notTaken = assembler_.jump(op == 5 ? Equal : NotEqual);
+					loadOperand(rcx, args[1], pMode2);
+					next(rcx, count + 1);
+					assembler_.bind(notTaken);
+					break;
+				}
+				default:
+					if (mayCall(args[1], pMode2)) {
+						loadOperand(rax, args[0], pMode1);
+						assembler_.store(rsp, spillOffset, rax);
+						loadOperand(rcx, args[1], pMode2);
+						assembler_.load(rax, rsp, spillOffset);
+					}
+					else {
+						loadOperand(rax, args[0], pMode1);
+						loadOperand(rcx, args[1], pMode2);
+					}
+
+					switch (op) {
+					case 1: assembler_.add(rax, rcx); break;
+					case 2: assembler_.imul(rax, rcx); break;
+					case 7:
+						assembler_.cmp(rax, rcx);
+						assembler_.setRax(Less);
+						break;
+					default:
+						assembler_.cmp(rax, rcx);
+						assembler_.setRax(Equal);
+						break;
+					}
+					storeResult(args[2], pMode3, position + nArgs + 1);
+					break;
+				}
+				return true;
+			}
+
+			void next(std::int64_t position, std::int64_t count)
+			{
+				assembler_.mov(rax, position);
+				chain(count);
+			}
+
+		private:
+			bool isInImage(std::int64_t address) const { return address >= 0 && address < imageSize_; }
+
+			bool mayCall(std::int64_t arg, int pMode) const { return pMode == Relative || (pMode == Position && !isInImage(arg)); }
+
+			void next(Register position, std::int64_t count)
+			{
+				assembler_.mov(rax, position);
+				chain(count);
+			}
+
+			void exit(std::int64_t position, std::int64_t count)
+			{
+				assembler_.mov(rax, position);
+				assembler_.add(rbp, static_cast<std::int32_t>(count));
+				epilogue();
+			}
+
+			void chain(std::int64_t count)
+			{
+				assembler_.add(rbp, static_cast<std::int32_t>(count));
+				assembler_.cmp(rax, r12);
+				const auto outside = assembler_.jump(AboveOrEqual);
+				assembler_.load(rcx, r14, bodiesOffset);
+				assembler_.loadIndexed(rcx, rcx, rax);
+				assembler_.test(rcx, rcx);
+				const auto notCompiled = assembler_.jump(Equal);
+				assembler_.jump(rcx);
+				assembler_.bind(outside);
+				assembler_.bind(notCompiled);
+				epilogue();
+			}
+
+			void epilogue()
+			{
+				assembler_.store(r14, relativeBaseOffset, r13);
+				assembler_.store(r14, nInstructionsOffset, rbp);
+				assembler_.addRsp(frameSize);
+				for (const auto r : { r15, r14, r13, r12, rbp, rbx })
+					assembler_.pop(r);
+				assembler_.ret();
+			}
+
+			void relativeAddress(std::int64_t arg)
+			{
+				if (fitsInt32(arg))
+					assembler_.lea(rdx, r13, static_cast<std::int32_t>(arg));
+				else {
+					assembler_.mov(rdx, arg);
+					assembler_.add(rdx, r13);
+				}
+			}
+
+			void callRead()
+			{
+				assembler_.mov(argument1, r14);
+				assembler_.call(r14, readOffset);
+				assembler_.cmpByteZero(r14, bailOffset);
+				const auto noBail = assembler_.jump(Equal);
+				exit(position_, count_);
+				assembler_.bind(noBail);
+			}
+
+			void callWrite(std::int64_t nextPosition)
+			{
+				assembler_.mov(argument3, rax);
+				assembler_.mov(argument1, r14);
+				assembler_.call(r14, writeOffset);
+				assembler_.testAl();
+				const auto noBail = assembler_.jump(Equal);
+				exit(nextPosition, count_ + 1);
+				assembler_.bind(noBail);
+			}
+
+			// Jumps to the returned label, with rdx untouched, unless the address in rdx is on the page the program last wrote beyond
+			// the image. Otherwise leaves scratch pointing at that page and rdx at the offset in it.
+			size_t findPage(Register scratch)
+			{
+				assembler_.mov(scratch, rdx);
+				assembler_.shr(scratch, static_cast<std::uint8_t>(Memory::getPageShift()));
+				assembler_.cmp(scratch, r14, pageIndexOffset);
+				const auto otherPage = assembler_.jump(NotEqual);
+				assembler_.load(scratch, r14, pageOffset);
+				assembler_.andMask(rdx, static_cast<std::int32_t>(Memory::getPageSize() - 1));
+				return otherPage;
+			}
+
+			// Loads the value at the address in rdx, which is beyond the image.
+			void loadOutside(Register target)
+			{
+				const auto otherPage = findPage(target);
+				assembler_.loadIndexed(target, target, rdx);
+				const auto done = assembler_.jump();
+				assembler_.bind(otherPage);
+				assembler_.mov(argument2, rdx);
+				callRead();
+				assembler_.mov(target, rax);
+				assembler_.bind(done);
+			}
+
+			void loadOperand(Register target, std::int64_t arg, int pMode)
+			{
+				switch (pMode) {
+				case Immediate: assembler_.mov(target, arg); break;
+				case Position:
+					if (isInImage(arg))
+						assembler_.load(target, rbx, static_cast<std::int32_t>(arg * 8));
+					else {
+						assembler_.mov(rdx, arg);
+						loadOutside(target);
+					}
+					break;
+				default: {
+					relativeAddress(arg);
+					assembler_.cmp(rdx, r12);
+					const auto outside = assembler_.jump(AboveOrEqual);
+					assembler_.loadIndexed(target, rbx, rdx);
+					const auto done = assembler_.jump();
+					assembler_.bind(outside);
+					loadOutside(target);
+					assembler_.bind(done);
+					break;
+				}
+				}
+			}
+
+			void storeResult(std::int64_t arg, int pMode, std::int64_t nextPosition)
+			{
+				auto slow = size_t{};
+				auto done = size_t{};
+				if (pMode == Position && isInImage(arg)) {
+					assembler_.cmpByteZero(r15, static_cast<std::int32_t>(arg));
+					slow = assembler_.jump(NotEqual);
+					assembler_.store(rbx, static_cast<std::int32_t>(arg * 8), rax);
+					done = assembler_.jump();
+					assembler_.bind(slow);
+					assembler_.mov(argument2, arg);
+					callWrite(nextPosition);
+					assembler_.bind(done);
+					return;
+				}
+
+				auto outside = size_t{};
+				if (pMode == Position)
+					assembler_.mov(rdx, arg);
+				else {
+					relativeAddress(arg);
+					assembler_.cmp(rdx, r12);
+					outside = assembler_.jump(AboveOrEqual);
+					assembler_.cmpByteZero(r15, rdx);
+					slow = assembler_.jump(NotEqual);
+					assembler_.storeIndexed(rbx, rdx, rax);
+					done = assembler_.jump();
+					assembler_.bind(outside);
+				}
+
+				// Compiled code never lies beyond the image, so stores there only have to find their page.
+				const auto otherPage = findPage(rcx);
+				assembler_.storeIndexed(rcx, rdx, rax);
+				const auto stored = assembler_.jump();
+				assembler_.bind(otherPage);
+				if (slow)
+					assembler_.bind(slow);
+				assembler_.mov(argument2, rdx);
+				callWrite(nextPosition);
+				assembler_.bind(stored);
+				if (done)
+					assembler_.bind(done);
+			}
+
+			Assembler           assembler_;
+			const std::int64_t* image_;
+			std::int64_t        imageSize_;
+			std::int64_t        position_ = 0;
+			std::int64_t        count_    = 0;
+		};
+	}
+
+	Jit::~Jit()
+	{
+#if defined(OPCODE_JIT) && defined(_WIN32)
+		if (buffer_)
+			VirtualFree(buffer_, 0, MEM_RELEASE);
+#elif defined(OPCODE_JIT)
+		if (buffer_)
+			munmap(buffer_, bufferSize);
+#endif
+	}
+
+	bool Jit::isSupported()
+	{
+#if defined(OPCODE_JIT)
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	Jit::Block Jit::compile(const std::int64_t* image, size_t imageSize, std::int64_t position, size_t& size)
+	{
+		size = 0;
+#if defined(OPCODE_JIT)
+		if (static_cast<std::uint64_t>(position) >= imageSize || imageSize > std::numeric_limits<std::int32_t>::max() / 8)
+			return nullptr;
+
+		// The buffer is never writable and executable at once: it is mapped writable, and made executable again before any block runs.
+		if (!buffer_) {
+#if defined(_WIN32)
+			buffer_ = static_cast<std::uint8_t*>(VirtualAlloc(nullptr, bufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+#else
+			auto buffer = mmap(nullptr, bufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			buffer_     = buffer == MAP_FAILED ? nullptr : static_cast<std::uint8_t*>(buffer);
+#endif
+			if (!buffer_)
+				return nullptr;
+			isExecutable_ = false;
+		}
+		else if (!setExecutable(false))
+			return nullptr;
+
+		getCoverage(imageSize);
+		if (used_ + maxBlockSize * maxInstructionBytes > bufferSize)
+			flush();
+
+		auto compiler = Compiler{ buffer_ + used_, image, static_cast<std::int64_t>(imageSize) };
+		compiler.prologue();
+		const auto body = compiler.getSize();
+
+		auto end   = position;
+		auto count = std::int64_t{ 0 };
+		while (count < maxBlockSize && end < static_cast<std::int64_t>(imageSize)) {
+			if (!compiler.instruction(end, count))
+				break;
+			const auto op = image[end] % 100;
+			end += op == 9 ? 2 : op == 5 || op == 6 ? 3 : 4;
+			++count;
+		}
+
+		if (count == 0) {
+			setExecutable(true);
+			return nullptr;
+		}
+
+		compiler.next(end, count);
+		if (!setExecutable(true)) {
+			flush();
+			return nullptr;
+		}
+
+		const auto block = reinterpret_cast<Block>(buffer_ + used_);
+		bodies_[position] = buffer_ + used_ + body;
+		used_ += compiler.getSize();
+
+		size                    = static_cast<size_t>(end - position);
+		blocks_[position].block = block;
+		blocks_[position].size  = static_cast<std::uint32_t>(size);
+		for (auto i = position; i < end; ++i)
+			++coverage_[i];
+		return block;
+#else
+		return nullptr;
+#endif
+	}
+
+	const std::uint8_t* Jit::getCoverage(size_t imageSize)
+	{
+		if (coverage_.size() != imageSize) {
+			blocks_.assign(imageSize, Entry{});
+			bodies_.assign(imageSize, nullptr);
+			coverage_.assign(imageSize, 0);
+			hotness_.assign(imageSize, 0);
+		}
+		return coverage_.data();
+	}
+
+	bool Jit::isCovered(std::int64_t position) const
+	{ //
+		return static_cast<std::uint64_t>(position) < coverage_.size() && coverage_[static_cast<size_t>(position)] != 0;
+	}
+
+	void Jit::invalidate(std::int64_t position)
+	{
+		if (!isCovered(position))
+			return;
+
+		const auto first = std::max(std::int64_t{ 0 }, position - maxBlockSpan + 1);
+		for (auto start = first; start <= position; ++start) {
+			auto& entry = blocks_[start];
+			if (entry.block && start + entry.size > position) {
+				for (auto i = start; i < start + entry.size; ++i)
+					--coverage_[i];
+				entry           = Entry{};
+				bodies_[start]  = nullptr;
+				hotness_[start] = 0;
+			}
+		}
+	}
+
+	void Jit::flush()
+	{
+		std::fill(blocks_.begin(), blocks_.end(), Entry{});
+		std::fill(bodies_.begin(), bodies_.end(), nullptr);
+		std::fill(coverage_.begin(), coverage_.end(), std::uint8_t{ 0 });
+		std::fill(hotness_.begin(), hotness_.end(), std::uint8_t{ 0 });
+		used_ = 0;
+	}
+
+	bool Jit::setExecutable(bool isExecutable)
+	{
+		if (isExecutable == isExecutable_)
+			return true;
+#if defined(OPCODE_JIT) && defined(_WIN32)
+		auto oldProtection = DWORD{};
+		if (!VirtualProtect(buffer_, bufferSize, isExecutable ? PAGE_EXECUTE_READ : PAGE_READWRITE, &oldProtection))
+			return false;
+		if (isExecutable)
+			FlushInstructionCache(GetCurrentProcess(), buffer_, bufferSize);
+#elif defined(OPCODE_JIT)
+		if (mprotect(buffer_, bufferSize, isExecutable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE) != 0)
+			return false;
+#endif
+		isExecutable_ = isExecutable;
+		return true;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace opcode {
+	class Jit
+	{
+	public:
+		struct Context
+		{
+			std::int64_t*       image;
+			std::uint64_t       imageSize;
+			const std::uint8_t* coverage;
+			const void* const*  bodies;
+			std::int64_t        relativeBase;
+			std::uint64_t       nInstructions;
+			std::int64_t        pageIndex;
+			std::int64_t*       page;
+			bool                bail;
+			void*               owner;
+			std::int64_t (*read)(Context* context, std::int64_t address);
+			bool (*write)(Context* context, std::int64_t address, std::int64_t value);
+		};
+
+		using Block = std::int64_t (*)(Context* context);
+
+		Jit() = default;
+		Jit(const Jit&) : Jit{} {}
+		Jit& operator=(const Jit&) = delete;
+		~Jit();
+
+		static bool isSupported();
+
+		Block find(std::int64_t position) const
+		{
+			if (static_cast<std::uint64_t>(position) >= blocks_.size())
+				return nullptr;
+			return blocks_[static_cast<size_t>(position)].block;
+		}
+
+		// Counts the entries into a position without a block, and tells once when it has been entered often enough to be compiled.
+		bool isHot(std::int64_t position)
+		{
+			if (static_cast<std::uint64_t>(position) >= hotness_.size() || hotness_[static_cast<size_t>(position)] > hotThreshold)
+				return false;
+			return ++hotness_[static_cast<size_t>(position)] > hotThreshold;
+		}
+
+		Block               compile(const std::int64_t* image, size_t imageSize, std::int64_t position, size_t& size);
+		const std::uint8_t* getCoverage(size_t imageSize);
+		const void* const*  getBodies() const { return bodies_.data(); }
+		bool                isCovered(std::int64_t position) const;
+		void                invalidate(std::int64_t position);
+
+	private:
+		static constexpr std::uint8_t hotThreshold = 16;
+
+		struct Entry
+		{
+			Block         block = nullptr;
+			std::uint32_t size  = 0;
+		};
+
+		void flush();
+		bool setExecutable(bool isExecutable);
+
+		std::uint8_t*             buffer_       = nullptr;
+		size_t                    used_         = 0;
+		bool                      isExecutable_ = false;
+		std::vector<Entry>        blocks_;
+		std::vector<const void*>  bodies_;
+		std::vector<std::uint8_t> coverage_;
+		std::vector<std::uint8_t> hotness_;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,123 @@
+#include "memory.h"
+
+#include <algorithm>
+#include <exception>
+
+namespace opcode {
+	Memory::Memory(std::vector<std::int64_t> image)
+	    : image_{ std::make_shared<std::vector<std::int64_t>>(std::move(image)) }, imageData_{ image_->data() }, imageSize_{ image_->size() }
+	{
+	}
+
+	Memory::Memory(const Memory& other)
+	    : image_{ other.image_ }, imageData_{ other.imageData_ }, imageSize_{ other.imageSize_ }, imageShared_{ true }, pages_{ other.pages_ }
+	{
+		if (!other.imageShared_)
+			throw std::exception{ "memory copied without being shared" };
+	}
+
+	void Memory::share()
+	{
+		imageShared_ = true;
+		resetCaches();
+	}
+
+	std::vector<std::int64_t> Memory::releaseImage()
+	{
+		auto image = image_.use_count() == 1 ? std::move(*image_) : *image_;
+
+		image_.reset();
+		imageData_   = nullptr;
+		imageSize_   = 0;
+		imageShared_ = false;
+		pages_.clear();
+		resetCaches();
+		return image;
+	}
+
+	void Memory::zeroPages()
+	{
+		for (auto it = pages_.begin(); it != pages_.end();) {
+			if (it->second.use_count() > 1)
+				it = pages_.erase(it);
+			else {
+				it->second->fill(0);
+				++it;
+			}
+		}
+		resetCaches();
+	}
+
+	std::vector<std::pair<std::int64_t, const std::int64_t*>> Memory::getPages() const
+	{
+		auto pages = std::vector<std::pair<std::int64_t, const std::int64_t*>>{};
+		pages.reserve(pages_.size());
+		for (const auto& page : pages_)
+			pages.emplace_back(page.first, page.second->data());
+		std::sort(pages.begin(), pages.end());
+		return pages;
+	}
+
+	void Memory::setPage(std::int64_t pageIndex, const std::int64_t* values)
+	{
+		if (pageIndex < 0 || pageIndex > std::numeric_limits<std::int64_t>::max() >> pageShift)
+			throw std::exception{ "invalid page index" };
+
+		auto page = std::make_shared<Page>();
+		std::copy(values, values + pageSize, page->begin());
+		pages_[pageIndex] = std::move(page);
+		resetCaches();
+	}
+
+	std::int64_t Memory::readPage(std::int64_t address) const
+	{
+		if (address < 0)
+			throw std::exception{ "negative address" };
+
+		const auto pageIndex = address >> pageShift;
+		const auto it        = pages_.find(pageIndex);
+		if (it == pages_.end())
+			return 0;
+
+		readPageIndex_ = pageIndex;
+		readPage_      = it->second.get();
+		return (*readPage_)[address & pageMask];
+	}
+
+	void Memory::writePage(std::int64_t address, std::int64_t value)
+	{
+		if (address < 0)
+			throw std::exception{ "negative address" };
+
+		const auto pageIndex = address >> pageShift;
+		auto       it        = pages_.find(pageIndex);
+		if (it == pages_.end()) {
+			if (value == 0)
+				return;
+			it = pages_.emplace(pageIndex, std::make_shared<Page>()).first;
+		}
+		else if (it->second.use_count() > 1)
+			it->second = std::make_shared<Page>(*it->second);
+
+		readPageIndex_ = writePageIndex_ = pageIndex;
+		readPage_ = writePage_ = it->second.get();
+		(*writePage_)[address & pageMask] = value;
+	}
+
+	void Memory::detachImage()
+	{
+		if (image_.use_count() > 1) {
+			image_     = std::make_shared<std::vector<std::int64_t>>(*image_);
+			imageData_ = image_->data();
+		}
+		imageShared_ = false;
+	}
+
+	void Memory::resetCaches() const
+	{
+		readPageIndex_  = noPage;
+		readPage_       = nullptr;
+		writePageIndex_ = noPage;
+		writePage_      = nullptr;
+	}
+}
\ No newline at end of file
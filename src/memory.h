@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace opcode {
+	class Memory
+	{
+	public:
+		explicit Memory(std::vector<std::int64_t> image);
+
+		// Copies share the image and pages with the source until either side writes them. Copying leaves the source untouched, so
+		// that a memory nobody writes any more can be copied from several threads; the source must have been shared first.
+		Memory(const Memory& other);
+		Memory(Memory&& other) = default;
+
+		Memory& operator=(const Memory&) = delete;
+		Memory& operator=(Memory&& other) = default;
+
+		std::int64_t read(std::int64_t address) const
+		{
+			if (static_cast<std::uint64_t>(address) < imageSize_)
+				return imageData_[address];
+			if (address >> pageShift == readPageIndex_)
+				return (*readPage_)[address & pageMask];
+			return readPage(address);
+		}
+
+		void write(std::int64_t address, std::int64_t value)
+		{
+			if (static_cast<std::uint64_t>(address) < imageSize_) {
+				if (imageShared_)
+					detachImage();
+				imageData_[address] = value;
+			}
+			else if (address >> pageShift == writePageIndex_)
+				(*writePage_)[address & pageMask] = value;
+			else
+				writePage(address, value);
+		}
+
+		std::int64_t* getWritableImage()
+		{
+			if (imageShared_)
+				detachImage();
+			return imageData_;
+		}
+
+		const std::vector<std::int64_t>& getImage() const { return *image_; }
+		size_t                           getImageSize() const { return imageSize_; }
+		size_t                           getNPages() const { return pages_.size(); }
+
+		// Makes the next writes copy the image and the pages they touch rather than change them in place.
+		void share();
+
+		void zeroPages();
+
+		// The page the last write beyond the image went to, if any. It can be written in place until the memory is shared or reset.
+		std::int64_t  getWritePageIndex() const { return writePageIndex_; }
+		std::int64_t* getWritePage() const { return writePage_ ? writePage_->data() : nullptr; }
+
+		// Pages beyond the image by increasing index, to save the memory and restore it with setPage().
+		static constexpr std::int64_t                              getPageShift() { return pageShift; }
+		static constexpr std::int64_t                              getPageSize() { return pageSize; }
+		std::vector<std::pair<std::int64_t, const std::int64_t*>> getPages() const;
+		void                                                       setPage(std::int64_t pageIndex, const std::int64_t* values);
+
+		std::vector<std::int64_t> releaseImage();
+
+	private:
+		static constexpr std::int64_t pageShift = 9;
+		static constexpr std::int64_t pageSize  = std::int64_t{ 1 } << pageShift;
+		static constexpr std::int64_t pageMask  = pageSize - 1;
+		static constexpr std::int64_t noPage    = std::numeric_limits<std::int64_t>::max();
+
+		using Page = std::array<std::int64_t, pageSize>;
+
+		std::int64_t readPage(std::int64_t address) const;
+		void         writePage(std::int64_t address, std::int64_t value);
+		void         detachImage();
+		void         resetCaches() const;
+
+		std::shared_ptr<std::vector<std::int64_t>>              image_;
+		std::int64_t*                                           imageData_;
+		std::uint64_t                                           imageSize_;
+		bool                                                    imageShared_ = false;
+		std::unordered_map<std::int64_t, std::shared_ptr<Page>> pages_;
+		mutable std::int64_t                                    readPageIndex_  = noPage;
+		mutable const Page*                                     readPage_       = nullptr;
+		mutable std::int64_t                                    writePageIndex_ = noPage;
+		mutable Page*                                           writePage_      = nullptr;
+	};
+}
\ No newline at end of file
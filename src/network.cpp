@@ -0,0 +1,267 @@
+#include "network.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <thread>
+#include <utility>
+
+namespace opcode {
+	struct Network::Node
+	{
+		Node(std::vector<std::int64_t> code, std::int64_t address, const Options& options) : machine{ std::move(code), options } { machine.pushInput(address); }
+
+		Machine                                           machine;
+		std::deque<std::pair<std::int64_t, std::int64_t>> packets;
+		std::vector<std::int64_t>                         outputs;
+		bool                                              polled  = false;
+		bool                                              blocked = false;
+		bool                                              halted  = false;
+	};
+
+	struct Network::Shard
+	{
+		std::deque<std::int64_t> ready;
+		std::vector<Packet>      mailbox;
+		std::mutex               mutex;
+		std::condition_variable  wakeUp;
+	};
+
+	Network::Network(std::vector<std::int64_t> code, size_t nMachines, const Options& options) : code_{ std::move(code) }
+	{
+		for (size_t address = 0; address < nMachines; ++address)
+			nodes_.push_back(std::make_unique<Node>(code_, static_cast<std::int64_t>(address), options));
+	}
+
+	Network::~Network() = default;
+
+	void Network::setOptions(std::int64_t address, const Options& options) { nodes_.at(static_cast<size_t>(address)) = std::make_unique<Node>(code_, address, options); }
+
+	void Network::send(const Packet& packet)
+	{
+		if (packet.to < 0 || packet.to >= static_cast<std::int64_t>(nodes_.size()))
+			throw std::exception{ "no machine at this address" };
+
+		++nSent_;
+		if (shards_.empty())
+			deliver(packet, ready_);
+		else
+			post(packet);
+	}
+
+	void Network::stop()
+	{
+		stopped_ = true;
+		for (auto& shard : shards_) {
+			std::lock_guard<std::mutex> lock{ shard->mutex };
+			shard->wakeUp.notify_all();
+		}
+	}
+
+	void Network::run()
+	{
+		stopped_ = false;
+		ready_.clear();
+		for (size_t address = 0; address < nodes_.size(); ++address)
+			if (isRunnable(address))
+				ready_.push_back(static_cast<std::int64_t>(address));
+
+		const auto route = [&](const Packet& packet) {
+			if (packet.to >= 0 && packet.to < static_cast<std::int64_t>(nodes_.size()))
+				deliver(packet, ready_);
+			else if (packetFunction_)
+				packetFunction_(packet);
+		};
+
+		while (!stopped_) {
+			if (ready_.empty()) {
+				const auto nSent = nSent_.load();
+				if (idleFunction_)
+					idleFunction_();
+				if (nSent_ == nSent)
+					break;
+				continue;
+			}
+
+			const auto address = ready_.front();
+			ready_.pop_front();
+			if (service(address, route))
+				ready_.push_back(address);
+		}
+	}
+
+	void Network::run(size_t nShards)
+	{
+		if (nodes_.empty())
+			return;
+
+		nShards = std::max(std::min(nShards, nodes_.size()), size_t{ 1 });
+		for (size_t i = 0; i < nShards; ++i)
+			shards_.push_back(std::make_unique<Shard>());
+
+		// One count is held until the shards are filled, so that a network with nothing runnable goes idle once, here.
+		stopped_  = false;
+		nPending_ = 1;
+		ready_.clear();
+		for (size_t address = 0; address < nodes_.size(); ++address) {
+			if (isRunnable(address)) {
+				++nPending_;
+				shards_[address % nShards]->ready.push_back(static_cast<std::int64_t>(address));
+			}
+		}
+		release();
+
+		auto threads = std::vector<std::thread>{};
+		for (size_t i = 1; i < nShards; ++i)
+			threads.emplace_back([this, i] { runShard(i); });
+		runShard(0);
+		for (auto& thread : threads)
+			thread.join();
+
+		// Later sends and runs are on the calling thread again.
+		shards_.clear();
+	}
+
+	// Machines blocked on an empty queue or halted by an earlier run are left out until a packet wakes them.
+	bool Network::isRunnable(size_t address) const { return !nodes_[address]->blocked && !nodes_[address]->halted; }
+
+	std::uint64_t Network::getNInstructions() const
+	{
+		auto nInstructions = std::uint64_t{};
+		for (const auto& node : nodes_)
+			nInstructions += node->machine.getNInstructions();
+		return nInstructions;
+	}
+
+	// Returns true if the machine was preempted and is still runnable.
+	template<typename Route> bool Network::service(std::int64_t address, Route&& route)
+	{
+		auto&      node     = *nodes_[static_cast<size_t>(address)];
+		const auto sliceEnd = node.machine.getNInstructions() + sliceSize;
+		for (;;) {
+			const auto nInstructions = node.machine.getNInstructions();
+			switch (node.machine.resume(nInstructions < sliceEnd ? sliceEnd - nInstructions : 0)) {
+			case Status::NeedInput:
+				if (!node.packets.empty()) {
+					node.machine.pushInput(node.packets.front().first);
+					node.machine.pushInput(node.packets.front().second);
+					node.packets.pop_front();
+					node.polled = false;
+				}
+				else if (node.polled) {
+					node.blocked = true;
+					return false;
+				}
+				else {
+					node.machine.pushInput(-1);
+					node.polled = true;
+				}
+				break;
+			case Status::Output:
+				node.outputs.push_back(node.machine.popOutput());
+				node.polled = false;
+				if (node.outputs.size() == 3) {
+					route(Packet{ address, node.outputs[0], node.outputs[1], node.outputs[2] });
+					node.outputs.clear();
+				}
+				break;
+			case Status::Preempted: return true;
+			case Status::Stopped: stop(); return false;
+			default: node.halted = true; return false;
+			}
+		}
+	}
+
+	void Network::deliver(const Packet& packet, std::deque<std::int64_t>& ready)
+	{
+		auto& node = *nodes_[static_cast<size_t>(packet.to)];
+		if (node.halted)
+			return;
+
+		node.packets.emplace_back(packet.x, packet.y);
+		if (node.blocked) {
+			node.blocked = false;
+			++nPending_;
+			ready.push_back(packet.to);
+		}
+	}
+
+	void Network::runShard(size_t index)
+	{
+		auto& shard = *shards_[index];
+		auto  inbox = std::vector<Packet>{};
+
+		const auto route = [&](const Packet& packet) {
+			if (packet.to >= 0 && packet.to < static_cast<std::int64_t>(nodes_.size())) {
+				if (static_cast<size_t>(packet.to) % shards_.size() == index)
+					deliver(packet, shard.ready);
+				else
+					post(packet);
+			}
+			else if (packetFunction_) {
+				std::lock_guard<std::mutex> lock{ packetMutex_ };
+				packetFunction_(packet);
+			}
+		};
+
+		while (!stopped_) {
+			{
+				std::lock_guard<std::mutex> lock{ shard.mutex };
+				inbox.swap(shard.mailbox);
+			}
+			for (const auto& packet : inbox) {
+				deliver(packet, shard.ready);
+				release();
+			}
+			inbox.clear();
+
+			if (!shard.ready.empty()) {
+				const auto address = shard.ready.front();
+				shard.ready.pop_front();
+				if (service(address, route))
+					shard.ready.push_back(address);
+				else
+					release();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock{ shard.mutex };
+			shard.wakeUp.wait(lock, [&] { return !shard.mailbox.empty() || stopped_; });
+		}
+	}
+
+	void Network::post(const Packet& packet)
+	{
+		// Counted before it is visible, so that the network cannot look idle while the packet is in a mailbox.
+		++nPending_;
+		auto& shard = *shards_[static_cast<size_t>(packet.to) % shards_.size()];
+		{
+			std::lock_guard<std::mutex> lock{ shard.mutex };
+			shard.mailbox.push_back(packet);
+		}
+		shard.wakeUp.notify_one();
+	}
+
+	void Network::release()
+	{
+		if (--nPending_ == 0)
+			idle();
+	}
+
+	void Network::idle()
+	{
+		// Nothing is runnable nor in flight. Hold a count while the idle function runs, so that what it sends cannot bring the
+		// count back to zero and call it again concurrently, and the packet lock, so that it sees what the packet function wrote.
+		++nPending_;
+		const auto nSent = nSent_.load();
+		if (idleFunction_ && !stopped_) {
+			std::lock_guard<std::mutex> lock{ packetMutex_ };
+			idleFunction_();
+		}
+		if (nSent_ == nSent) {
+			stop();
+			return;
+		}
+		release();
+	}
+}
\ No newline at end of file
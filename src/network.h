@@ -0,0 +1,86 @@
+#pragma once
+
+#include "opcode.h"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace opcode {
+	struct Packet
+	{
+		std::int64_t from;
+		std::int64_t to;
+		std::int64_t x;
+		std::int64_t y;
+	};
+
+	// Network of machines running the same program. Each machine first reads its address, then reads packets as (x, y) pairs or -1
+	// when none is queued, and sends packets by outputting (to, x, y). Machines are resumed only when they can make progress: one
+	// that asks for input again after reading -1 without outputting anything is blocked until a packet arrives. The network is idle,
+	// exactly, when every queue is empty and every machine is blocked or halted. A machine that runs sliceSize instructions without
+	// blocking is preempted and queued again behind the others.
+	//
+	// Packets sent outside the network go to the packet function. When the network goes idle the idle function is called; the network
+	// stops if it sends nothing. Both functions may call send() and stop(), and are never called concurrently: sharded runs call them
+	// under the same lock.
+	class Network
+	{
+	public:
+		using PacketFunction = std::function<void(const Packet&)>;
+		using IdleFunction   = std::function<void()>;
+
+		Network(std::vector<std::int64_t> code, size_t nMachines, const Options& options = {});
+		~Network();
+
+		Network(const Network&) = delete;
+		Network& operator=(const Network&) = delete;
+
+		void setOptions(std::int64_t address, const Options& options);
+		void setPacketFunction(PacketFunction packetFunction) { packetFunction_ = std::move(packetFunction); }
+		void setIdleFunction(IdleFunction idleFunction) { idleFunction_ = std::move(idleFunction); }
+
+		void send(const Packet& packet);
+		void stop();
+
+		// Runs the machines round-robin on the calling thread. Packets are delivered in the order they are sent, so runs are reproducible.
+		// A network can be run again after it went idle or was stopped, and goes on from where it was.
+		void run();
+
+		// Runs the machines on several threads, each owning the machines whose address modulo nShards is its index. Packets between
+		// shards go through mailboxes, and idleness is detected with a count of runnable machines plus packets in flight.
+		void run(size_t nShards);
+
+		std::uint64_t getNInstructions() const;
+
+	private:
+		struct Node;
+		struct Shard;
+
+		static constexpr std::uint64_t sliceSize = 1 << 16;
+
+		template<typename Route> bool service(std::int64_t address, Route&& route);
+
+		bool isRunnable(size_t address) const;
+		void deliver(const Packet& packet, std::deque<std::int64_t>& ready);
+		void runShard(size_t index);
+		void post(const Packet& packet);
+		void release();
+		void idle();
+
+		std::vector<std::int64_t>           code_;
+		std::vector<std::unique_ptr<Node>>  nodes_;
+		std::vector<std::unique_ptr<Shard>> shards_;
+		std::deque<std::int64_t>            ready_;
+		PacketFunction                      packetFunction_;
+		IdleFunction                        idleFunction_;
+		std::mutex                          packetMutex_;
+		std::atomic<std::int64_t>           nPending_{ 0 };
+		std::atomic<std::uint64_t>          nSent_{ 0 };
+		std::atomic<bool>                   stopped_{ false };
+	};
+}
\ No newline at end of file
@@ -1,209 +1,827 @@
 #include "opcode.h"
-
+#include "jit.h"
+#include "memory.h"
+#include "profile.h"
+#include "program.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <exception>
 #include <iostream>
 #include <unordered_map>
 
 namespace opcode {
-	namespace {
+	using namespace detail;
 
-		class Program
+	namespace {
+		// Runs that return only their outputs must have halted, or they would pass for complete.
+		void checkHalted(Status status)
 		{
-		public:
-			Program(std::vector<std::int64_t> code, std::function<std::int64_t()> inputFunction, std::function<void(std::int64_t)> outputFunction)
-			    : code_{ std::move(code) }, inputFunction_{ std::move(inputFunction) }, outputFunction_{ std::move(outputFunction) }
-			{
+			switch (status) {
+			case Status::Halted: break;
+			case Status::NeedInput: throw std::exception{ "no input available" };
+			case Status::Preempted: throw std::exception{ "instruction budget spent" };
+			case Status::Stopped: throw std::exception{ "run stopped" };
+			default: throw std::exception{ "run not finished" };
 			}
+		}
 
-			Program& run();
-
-			std::vector<std::int64_t> releaseCode() { return std::move(code_); }
-
-		private:
-			struct PModes
-			{
-				std::int64_t pMode1, pMode2, pMode3;
-			};
-
-			PModes        decodePModes();
-			std::int64_t  getValuePosition(std::int64_t position, std::int64_t pMode);
-			std::int64_t& getValue(std::int64_t position, std::int64_t pMode);
-
-			template<typename Operator> void  binaryOp(Operator op);
-			template<typename Predicate> void jumpIf(Predicate pred);
-
-			void add();
-			void multiply();
-			void readInput();
-			void writeOutput();
-			void jumpIfTrue();
-			void jumpIfFalse();
-			void lessThan();
-			void equals();
-			void adjustRelativeBase();
-
-			std::vector<std::int64_t>         code_;
-			std::int64_t                      position_     = 0;
-			std::int64_t                      relativeBase_ = 0;
-			std::function<std::int64_t()>     inputFunction_;
-			std::function<void(std::int64_t)> outputFunction_;
-		};
-
-		Program& Program::run()
+		// A reset writes back the words a run changed, which invalidates the compiled blocks covering them, so a Runner on the JIT
+		// recompiled and interpreted again on every run. Decoded records survive resets, and the runs a Runner repeats are short.
+		Options withoutJit(Options options)
 		{
-			for (;;) {
-				const auto instruction = code_[position_] % 100;
-				if (instruction == 99)
-					break;
-
-				switch (instruction) {
-				case 1: add(); break;
-				case 2: multiply(); break;
-				case 3: readInput(); break;
-				case 4: writeOutput(); break;
-				case 5: jumpIfTrue(); break;
-				case 6: jumpIfFalse(); break;
-				case 7: lessThan(); break;
-				case 8: equals(); break;
-				case 9: adjustRelativeBase(); break;
-				default: throw std::exception{ "unsupported opcode" };
-				}
-			}
-			return *this;
+			if (options.backend == Backend::Jit)
+				options.backend = Backend::Decoded;
+			return options;
 		}
 
-		Program::PModes Program::decodePModes()
+		// The overloads below know the types of their I/O, so the dispatch loops are compiled for them here and call them without going
+		// through detail::IO.
+		template<typename InputPolicy, typename OutputPolicy>
+		Status runDirect(std::vector<std::int64_t>& code, InputPolicy& inputPolicy, OutputPolicy& outputPolicy, const Options& options)
 		{
-			size_t opCode = code_[position_];
-			opCode /= 100;
-			const std::int64_t pMode1 = opCode % 10;
-			opCode /= 10;
-			const std::int64_t pMode2 = opCode % 10;
-			opCode /= 10;
-			const std::int64_t pMode3 = opCode % 10;
+			auto       policies = Policies<InputPolicy, OutputPolicy>{ inputPolicy, outputPolicy };
+			auto       program  = Program{ std::move(code), options };
+			const auto status   = program.run(policies);
+
+			if (options.statistics)
+				options.statistics->nInstructions += program.getNInstructions();
+			code = program.releaseCode();
+			return status;
+		}
+	}
 
-			return { pMode1, pMode2, pMode3 };
+	Status Program::resume(std::uint64_t budget)
+	{
+		if (start(budget))
+			dispatch();
+		return status_;
+	}
+
+	bool Program::start(std::uint64_t budget)
+	{
+		if (status_ == Status::Halted)
+			return false;
+		status_ = Status::Running;
+
+		const auto totalEnd = options_.budget ? options_.budget : unlimitedBudget;
+		budgetEnd_          = std::min(totalEnd, budget < unlimitedBudget - nInstructions_ ? nInstructions_ + budget : unlimitedBudget);
+		checkpoint_         = options_.stop ? std::min(budgetEnd_, nInstructions_ + StopSource::stopCheckInterval) : budgetEnd_;
+		return true;
+	}
+
+	void Program::dispatch()
+	{
+		if (options_.profile)
+			return runProfiled();
+
+		// Threaded and compiled code never come back to a checkpoint, so budgets and stop requests run decoded.
+		auto       queues    = Queues{};
+		const auto isChecked = checkpoint_ != unlimitedBudget;
+		if (options_.trace) {
+			if (isChecked)
+				runDecoded<true, true>(queues);
+			else
+				runDecoded<true, false>(queues);
+			return;
 		}
 
-		std::int64_t Program::getValuePosition(std::int64_t position, std::int64_t pMode)
-		{
-			switch (pMode) {
-			case 0: return code_[position];
-			case 1: return position;
-			case 2: return code_[position] + relativeBase_;
-			default: throw std::exception{ "unsupported parameter mode" };
-			}
+		switch (options_.backend) {
+		case Backend::Interpreter: runInterpreter(); break;
+		case Backend::Decoded:
+			if (isChecked)
+				runDecoded<false, true>(queues);
+			else
+				runDecoded<false, false>(queues);
+			break;
+		case Backend::Threaded:
+			if (isChecked)
+				runDecoded<false, true>(queues);
+			else
+				runThreaded(queues);
+			break;
+		case Backend::Jit:
+			if (isChecked)
+				runDecoded<false, true>(queues);
+			else
+				runJit();
+			break;
+		default: throw std::exception{ "unsupported backend" };
 		}
+	}
 
-		std::int64_t& Program::getValue(std::int64_t position, std::int64_t pMode)
-		{
-			position = getValuePosition(position, pMode);
-			if (static_cast<size_t>(position) >= code_.size())
-				code_.resize(static_cast<size_t>(position + 1), 0);
-			return code_[position];
+	void Program::reset(const std::vector<std::int64_t>& image)
+	{
+		const auto* data = memory_.getWritableImage();
+		for (size_t i = 0; i < image.size(); ++i) {
+			if (data[i] != image[i])
+				write(static_cast<std::int64_t>(i), image[i]);
 		}
+		memory_.zeroPages();
+
+		position_         = 0;
+		relativeBase_     = 0;
+		nextInput_        = 0;
+		nextOutput_       = 0;
+		status_           = Status::Running;
+		nInstructions_    = 0;
+		profileLastWrite_ = -1;
+		inputs_.clear();
+		outputs_.clear();
+		profileFrames_.clear();
+		profileReturns_.clear();
+	}
 
-		template<typename Operator> void Program::binaryOp(Operator op)
-		{
-			const auto pModes = decodePModes();
+	std::unique_ptr<Program> Program::fork()
+	{
+		// The profile, trace and statistics belong to this program's runs, and the fork may run on another thread.
+		memory_.share();
+		auto program                 = std::make_unique<Program>(*this);
+		program->options_.profile    = nullptr;
+		program->options_.trace      = nullptr;
+		program->options_.statistics = nullptr;
+		return program;
+	}
 
-			if (pModes.pMode3 == 1)
-				throw std::exception{ "unsupported parameter mode for third argument" };
+	void Program::saveState(std::vector<std::int64_t>& words) const
+	{
+		const auto& image    = memory_.getImage();
+		const auto  pages    = memory_.getPages();
+		const auto  pageSize = Memory::getPageSize();
+		const auto  nInputs  = inputs_.size() - nextInput_;
+		const auto  nOutputs = outputs_.size() - nextOutput_;
+
+		words.clear();
+		words.reserve(stateHeaderSize + image.size() + pages.size() * (pageSize + 1) + nInputs + nOutputs);
+		words.insert(words.end(), { position_, relativeBase_, static_cast<std::int64_t>(nInstructions_), static_cast<std::int64_t>(status_),
+		                              static_cast<std::int64_t>(image.size()), static_cast<std::int64_t>(pages.size()), static_cast<std::int64_t>(nInputs),
+		                              static_cast<std::int64_t>(nOutputs) });
+		words.insert(words.end(), image.begin(), image.end());
+		for (const auto& page : pages) {
+			words.push_back(page.first);
+			words.insert(words.end(), page.second, page.second + pageSize);
+		}
+		words.insert(words.end(), inputs_.begin() + nextInput_, inputs_.end());
+		words.insert(words.end(), outputs_.begin() + nextOutput_, outputs_.end());
+	}
 
-			const auto value1 = getValue(position_ + 1, pModes.pMode1);
-			const auto value2 = getValue(position_ + 2, pModes.pMode2);
-			auto&      value3 = getValue(position_ + 3, pModes.pMode3);
+	std::unique_ptr<Program> Program::loadState(const std::int64_t* words, size_t nWords, const Options& options)
+	{
+		if (nWords < stateHeaderSize)
+			throw std::exception{ "truncated machine state" };
+
+		const auto pageSize = static_cast<std::uint64_t>(Memory::getPageSize());
+		const auto status   = static_cast<std::uint64_t>(words[3]);
+		const auto sizes    = reinterpret_cast<const std::uint64_t*>(words + 4);
+		if (status > static_cast<std::uint64_t>(Status::Preempted) || sizes[0] > nWords || sizes[1] > nWords / (pageSize + 1) || sizes[2] > nWords
+		    || sizes[3] > nWords || nWords != stateHeaderSize + sizes[0] + sizes[1] * (pageSize + 1) + sizes[2] + sizes[3])
+			throw std::exception{ "corrupted machine state" };
+
+		auto next   = words + stateHeaderSize;
+		auto memory = Memory{ std::vector<std::int64_t>(next, next + sizes[0]) };
+		next += sizes[0];
+		for (std::uint64_t i = 0; i < sizes[1]; ++i, next += pageSize + 1)
+			memory.setPage(next[0], next + 1);
+
+		auto program            = std::make_unique<Program>(std::move(memory), words[0], words[1], options);
+		program->nInstructions_ = static_cast<std::uint64_t>(words[2]);
+		program->status_        = static_cast<Status>(status);
+		program->inputs_.assign(next, next + sizes[2]);
+		program->outputs_.assign(next + sizes[2], next + sizes[2] + sizes[3]);
+		return program;
+	}
 
-			value3 = op(value1, value2);
-			position_ += 4;
+	std::int64_t Program::popInput()
+	{
+		const auto value = inputs_[nextInput_++];
+		if (nextInput_ == inputs_.size()) {
+			inputs_.clear();
+			nextInput_ = 0;
 		}
+		return value;
+	}
 
-		template<typename Predicate> void Program::jumpIf(Predicate pred)
-		{
-			const auto pModes = decodePModes();
+	std::int64_t Program::popOutput()
+	{
+		if (!hasOutput())
+			throw std::exception{ "no output available" };
 
-			const auto value1 = getValue(position_ + 1, pModes.pMode1);
-			const auto value2 = getValue(position_ + 2, pModes.pMode2);
+		const auto value = outputs_[nextOutput_++];
+		if (nextOutput_ == outputs_.size()) {
+			outputs_.clear();
+			nextOutput_ = 0;
+		}
+		return value;
+	}
 
-			if (pred(value1))
-				position_ = value2;
+	void Program::runInterpreter()
+	{
+		while (status_ == Status::Running) {
+			if (nInstructions_ >= checkpoint_ && checkInterrupts())
+				return;
+			if (read(position_) % 100 == 99)
+				status_ = Status::Halted;
 			else
-				position_ += 3;
+				step();
 		}
+	}
 
-		void Program::add()
-		{
-			binaryOp([](auto a, auto b) { return a + b; });
+	// Steps through the interpreter and attributes every instruction to a call stack guessed from the code: a jump taken right after
+	// its own return address was written is a call, and a jump to a return address on the stack unwinds to that frame.
+	void Program::runProfiled()
+	{
+		auto& profile = *options_.profile;
+
+		while (status_ == Status::Running) {
+			if (nInstructions_ >= checkpoint_ && checkInterrupts())
+				return;
+
+			const auto position = position_;
+			const auto value    = read(position);
+			const auto op       = value % 100;
+			if (op == 99) {
+				status_ = Status::Halted;
+				break;
+			}
+
+			const auto   nArgs      = op == 3 || op == 4 || op == 9 ? 1 : op == 5 || op == 6 ? 2 : 3;
+			const auto   writes     = op == 3 || nArgs == 3;
+			const auto   nPages     = memory_.getNPages();
+			auto         modes      = value / 100;
+			std::int64_t targets[3] = { -1, -1, -1 };
+			for (auto i = 0; i < nArgs; ++i, modes /= 10) {
+				if (modes % 10 != Immediate)
+					targets[i] = read(position + i + 1) + (modes % 10 == Relative ? relativeBase_ : 0);
+			}
+
+			step();
+			if (status_ == Status::NeedInput)
+				break;
+
+			++profile.instructions[value];
+			++profile.positions[position];
+			profile.nGrowths += memory_.getNPages() - nPages;
+			for (auto i = 0; i < nArgs; ++i) {
+				if (targets[i] < 0)
+					continue;
+				if (writes && i == nArgs - 1)
+					++profile.writes[targets[i]];
+				else
+					++profile.reads[targets[i]];
+			}
+			++profile.stacks[profileFrames_];
+
+			if ((op == 5 || op == 6) && position_ != position + 3) {
+				const auto it = std::find(profileReturns_.rbegin(), profileReturns_.rend(), position_);
+				if (it != profileReturns_.rend()) {
+					const auto depth = static_cast<size_t>(profileReturns_.rend() - it) - 1;
+					profileFrames_.resize(depth);
+					profileReturns_.resize(depth);
+				}
+				else if (profileLastWrite_ == position + 3) {
+					profileFrames_.push_back(position_);
+					profileReturns_.push_back(position + 3);
+				}
+			}
+			profileLastWrite_ = writes ? read(targets[nArgs - 1]) : -1;
 		}
+	}
 
-		void Program::multiply()
-		{
-			binaryOp([](auto a, auto b) { return a * b; });
+	void Program::step()
+	{
+		const auto instruction = read(position_) % 100;
+
+		switch (instruction) {
+		case 1: add(); break;
+		case 2: multiply(); break;
+		case 3: readInput(); break;
+		case 4: writeOutput(); break;
+		case 5: jumpIfTrue(); break;
+		case 6: jumpIfFalse(); break;
+		case 7: lessThan(); break;
+		case 8: equals(); break;
+		case 9: adjustRelativeBase(); break;
+		default: throw std::exception{ "unsupported opcode" };
 		}
 
-		void Program::readInput()
-		{
-			const auto pModes = decodePModes();
+		if (status_ != Status::NeedInput)
+			++nInstructions_;
+	}
 
-			if (pModes.pMode1 == 1)
-				throw std::exception{ "unsupported parameter mode for first argument" };
+	// Called when the instruction count reaches the checkpoint. Stops or preempts the program, or else moves the checkpoint on.
+	bool Program::checkInterrupts()
+	{
+		if (options_.stop && options_.stop->isStopRequested()) {
+			status_ = Status::Stopped;
+			return true;
+		}
+		if (nInstructions_ >= budgetEnd_) {
+			status_ = Status::Preempted;
+			return true;
+		}
+		checkpoint_ = options_.stop ? std::min(budgetEnd_, nInstructions_ + StopSource::stopCheckInterval) : budgetEnd_;
+		return false;
+	}
 
-			auto& value = getValue(position_ + 1, pModes.pMode1);
-			value       = inputFunction_();
+	void Program::runJit()
+	{
+		if (!Jit::isSupported()) {
+			auto queues = Queues{};
+			return runDecoded<false, false>(queues);
+		}
+
+		// Compiled stores only check the compiled coverage, so records decoded by checked runs would go stale.
+		decoded_.clear();
+
+		const auto imageSize = memory_.getImageSize();
+		if (decodedPositions_.size() < imageSize)
+			decodedPositions_.resize(imageSize, false);
+
+		auto context = Jit::Context{ memory_.getWritableImage(), imageSize, jit_.getCoverage(imageSize), jit_.getBodies(), 0, 0, 0, nullptr, false, this,
+			&Program::jitRead, &Program::jitWrite };
+
+		// Code is interpreted until a position that is jumped to often enough gets compiled, so that short runs do not pay for
+		// compiling code they execute once.
+		auto isEntry = true;
+		while (status_ == Status::Running) {
+			auto block = jit_.find(position_);
+			if (!block && isEntry && jit_.isHot(position_)) {
+				auto size = size_t{};
+				block     = jit_.compile(context.image, imageSize, position_, size);
+				for (auto i = size_t{}; i < size; ++i)
+					decodedPositions_[position_ + i] = true;
+			}
 
-			position_ += 2;
+			if (block) {
+				context.relativeBase  = relativeBase_;
+				context.nInstructions = 0;
+				context.pageIndex     = memory_.getWritePageIndex();
+				context.page          = memory_.getWritePage();
+				position_             = block(&context);
+				relativeBase_         = context.relativeBase;
+				nInstructions_ += context.nInstructions;
+				isEntry = true;
+
+				if (context.bail) {
+					context.bail = false;
+					if (jitException_)
+						std::rethrow_exception(std::move(jitException_));
+				}
+			}
+			else if (read(position_) % 100 == 99)
+				status_ = Status::Halted;
+			else {
+				const auto previous = position_;
+				step();
+				isEntry = position_ <= previous || position_ > previous + static_cast<std::int64_t>(maxInstructionSize);
+			}
 		}
+	}
 
-		void Program::writeOutput()
-		{
-			const auto pModes = decodePModes();
+	std::int64_t Program::jitRead(Jit::Context* context, std::int64_t address)
+	{
+		auto program = static_cast<Program*>(context->owner);
+		try {
+			return program->read(address);
+		}
+		catch (...) {
+			program->jitException_ = std::current_exception();
+			context->bail          = true;
+			return 0;
+		}
+	}
 
-			const auto value = getValue(position_ + 1, pModes.pMode1);
-			outputFunction_(value);
+	bool Program::jitWrite(Jit::Context* context, std::int64_t address, std::int64_t value)
+	{
+		auto program = static_cast<Program*>(context->owner);
+		try {
+			const auto covered = program->jit_.isCovered(address);
+			program->write(address, value);
+			context->pageIndex = program->memory_.getWritePageIndex();
+			context->page      = program->memory_.getWritePage();
+			return covered;
+		}
+		catch (...) {
+			program->jitException_ = std::current_exception();
+			context->bail          = true;
+			return true;
+		}
+	}
 
-			position_ += 2;
+	const Instruction& Program::fetchUndecoded()
+	{
+		static const auto fallback = Instruction{ fallbackHandler };
+
+		const auto position = static_cast<size_t>(position_);
+		if (position >= decoded_.size()) {
+			if (position >= memory_.getImageSize())
+				return fallback;
+			decoded_.resize(memory_.getImageSize());
+			decodedPositions_.resize(memory_.getImageSize(), false);
 		}
 
-		void Program::jumpIfTrue()
-		{
-			return jumpIf([](auto value) { return value != 0; });
+		auto& instruction = decoded_[position];
+		decode(position, instruction);
+		return instruction;
+	}
+
+	void Program::decode(size_t position, Instruction& instruction)
+	{
+		instruction.handler         = fallbackHandler;
+		instruction.size            = 1;
+		decodedPositions_[position] = true;
+
+		const auto value = memory_.read(position);
+		if (value < 0)
+			return;
+
+		const auto op     = static_cast<int>(value % 100);
+		const auto pMode1 = static_cast<int>(value / 100 % 10);
+		const auto pMode2 = static_cast<int>(value / 1000 % 10);
+		const auto pMode3 = static_cast<int>(value / 10000 % 10);
+
+		if (op == 99) {
+			instruction.handler = haltHandler;
+			return;
 		}
 
-		void Program::jumpIfFalse()
-		{
-			return jumpIf([](auto value) { return value == 0; });
+		auto nArgs = 0;
+		switch (op) {
+		case 1:
+		case 2:
+		case 7:
+		case 8: nArgs = pMode1 <= Relative && pMode2 <= Relative && (pMode3 == Position || pMode3 == Relative) ? 3 : 0; break;
+		case 5:
+		case 6: nArgs = pMode1 <= Relative && pMode2 <= Relative ? 2 : 0; break;
+		case 3: nArgs = pMode1 == Position || pMode1 == Relative ? 1 : 0; break;
+		case 4:
+		case 9: nArgs = pMode1 <= Relative ? 1 : 0; break;
+		default: break;
 		}
 
-		void Program::lessThan()
-		{
-			binaryOp([](auto a, auto b) { return a < b ? 1 : 0; });
+		if (nArgs == 0 || position + nArgs >= memory_.getImageSize())
+			return;
+
+		instruction.handler = getHandler(op, pMode1, nArgs > 1 ? pMode2 : 0, nArgs > 2 ? pMode3 : 0);
+		instruction.size    = static_cast<std::uint8_t>(nArgs + 1);
+		for (auto i = 0; i < nArgs; ++i) {
+			instruction.args[i]                 = memory_.read(position + 1 + i);
+			decodedPositions_[position + 1 + i] = true;
 		}
 
-		void Program::equals()
-		{
-			binaryOp([](auto a, auto b) { return a == b ? 1 : 0; });
+		if (op == 1 || op == 2 || op == 7 || op == 8)
+			fuse(position, instruction, op, pMode1, pMode2, pMode3);
+	}
+
+	void Program::fuse(size_t position, Instruction& instruction, int op, int pMode1, int pMode2, int pMode3)
+	{
+		const auto next = position + 4;
+		if (next + 2 >= memory_.getImageSize())
+			return;
+
+		const auto jump      = memory_.read(next);
+		const auto jumpOp    = static_cast<int>(jump % 100);
+		const auto condMode  = static_cast<int>(jump / 100 % 10);
+		const auto condition = memory_.read(next + 1);
+		if (jump < 0 || (jumpOp != 5 && jumpOp != 6) || jump / 1000 % 10 != Immediate)
+			return;
+
+		auto fusedOp = 0;
+		if (op == 7 || op == 8) {
+			// The jump must test the flag that was just written, so the flag is never read back.
+			if (condMode != pMode3 || condition != instruction.args[2])
+				return;
+			fusedOp = (op == 7 ? LessThanJumpIfTrue : EqualsJumpIfTrue) + (jumpOp == 6 ? 1 : 0);
+		}
+		else {
+			if (condMode != Immediate || (condition != 0) != (jumpOp == 5))
+				return;
+			fusedOp = op == 1 ? AddJump : MultiplyJump;
 		}
 
-		void Program::adjustRelativeBase()
-		{
-			const auto pModes = decodePModes();
+		instruction.handler = getHandler(fusedOp, pMode1, pMode2, pMode3);
+		instruction.size    = 7;
+		instruction.args[3] = memory_.read(next + 2);
+		for (auto i = next; i < next + 3; ++i)
+			decodedPositions_[i] = true;
+	}
+
+	void Program::invalidate(size_t position)
+	{
+		jit_.invalidate(static_cast<std::int64_t>(position));
+
+		const auto first = position < maxInstructionSize ? 0 : position - maxInstructionSize + 1;
+		for (auto start = first; start <= position && start < decoded_.size(); ++start) {
+			auto& instruction = decoded_[start];
+			if (instruction.handler != undecodedHandler && start + instruction.size > position)
+				instruction = Instruction{};
+		}
+		decodedPositions_[position] = false;
+	}
+
+	void Program::stepTraced()
+	{
+		const auto position = position_;
+		const auto opCode   = read(position);
+		const auto op       = opCode % 100;
+		const auto pMode    = op == 3 ? opCode / 100 % 10 : opCode / 10000 % 10;
+		auto&      record   = options_.trace->claim();
+		record              = TraceRecord{ position, opCode, { read(position + 1), read(position + 2), read(position + 3) }, 0 };
+
+		step();
+		if (status_ == Status::NeedInput)
+			return;
+
+		switch (op) {
+		case 4: record.value = outputs_.back(); break;
+		case 5:
+		case 6: record.value = position_; break;
+		case 9: record.value = relativeBase_; break;
+		default: record.value = read((pMode == Relative ? relativeBase_ : 0) + record.args[op == 3 ? 0 : 2]); break;
+		}
+		options_.trace->commit();
+	}
+
+	Program::PModes Program::decodePModes()
+	{
+		size_t opCode = read(position_);
+		opCode /= 100;
+		const std::int64_t pMode1 = opCode % 10;
+		opCode /= 10;
+		const std::int64_t pMode2 = opCode % 10;
+		opCode /= 10;
+		const std::int64_t pMode3 = opCode % 10;
+
+		return { pMode1, pMode2, pMode3 };
+	}
+
+	std::int64_t Program::getValuePosition(std::int64_t position, std::int64_t pMode)
+	{
+		switch (pMode) {
+		case 0: return read(position);
+		case 1: return position;
+		case 2: return read(position) + relativeBase_;
+		default: throw std::exception{ "unsupported parameter mode" };
+		}
+	}
+
+	std::int64_t Program::getValue(std::int64_t position, std::int64_t pMode)
+	{ //
+		return read(getValuePosition(position, pMode));
+	}
+
+	void Program::setValue(std::int64_t position, std::int64_t pMode, std::int64_t value)
+	{ //
+		write(getValuePosition(position, pMode), value);
+	}
+
+	template<typename Operator> void Program::binaryOp(Operator op)
+	{
+		const auto pModes = decodePModes();
+
+		if (pModes.pMode3 == 1)
+			throw std::exception{ "unsupported parameter mode for third argument" };
 
-			const auto value = getValue(position_ + 1, pModes.pMode1);
-			relativeBase_ += value;
+		const auto value1 = getValue(position_ + 1, pModes.pMode1);
+		const auto value2 = getValue(position_ + 2, pModes.pMode2);
+		setValue(position_ + 3, pModes.pMode3, op(value1, value2));
+
+		position_ += 4;
+	}
+
+	template<typename Predicate> void Program::jumpIf(Predicate pred)
+	{
+		const auto pModes = decodePModes();
 
-			position_ += 2;
+		const auto value1 = getValue(position_ + 1, pModes.pMode1);
+		const auto value2 = getValue(position_ + 2, pModes.pMode2);
+
+		if (pred(value1))
+			position_ = value2;
+		else
+			position_ += 3;
+	}
+
+	void Program::add()
+	{
+		binaryOp([](auto a, auto b) { return a + b; });
+	}
+
+	void Program::multiply()
+	{
+		binaryOp([](auto a, auto b) { return a * b; });
+	}
+
+	void Program::readInput()
+	{
+		const auto pModes = decodePModes();
+
+		if (pModes.pMode1 == 1)
+			throw std::exception{ "unsupported parameter mode for first argument" };
+
+		if (!hasInput()) {
+			status_ = Status::NeedInput;
+			return;
 		}
+
+		setValue(position_ + 1, pModes.pMode1, popInput());
+
+		position_ += 2;
+	}
+
+	void Program::writeOutput()
+	{
+		const auto pModes = decodePModes();
+
+		const auto value = getValue(position_ + 1, pModes.pMode1);
+		outputs_.push_back(value);
+		status_ = Status::Output;
+
+		position_ += 2;
+	}
+
+	void Program::jumpIfTrue()
+	{
+		return jumpIf([](auto value) { return value != 0; });
+	}
+
+	void Program::jumpIfFalse()
+	{
+		return jumpIf([](auto value) { return value == 0; });
+	}
+
+	void Program::lessThan()
+	{
+		binaryOp([](auto a, auto b) { return a < b ? 1 : 0; });
+	}
+
+	void Program::equals()
+	{
+		binaryOp([](auto a, auto b) { return a == b ? 1 : 0; });
+	}
+
+	void Program::adjustRelativeBase()
+	{
+		const auto pModes = decodePModes();
+
+		const auto value = getValue(position_ + 1, pModes.pMode1);
+		relativeBase_ += value;
+
+		position_ += 2;
 	}
 
+	Machine::Machine(std::vector<std::int64_t> code, const Options& options) : program_{ std::make_unique<Program>(std::move(code), options) } {}
+
+	Machine::Machine(const Snapshot& snapshot) : program_{ std::make_unique<Program>(*snapshot.program_) } {}
+
+	Machine::Machine(Memory memory, std::int64_t position, std::int64_t relativeBase, const Options& options)
+	    : program_{ std::make_unique<Program>(std::move(memory), position, relativeBase, options) }
+	{
+	}
+
+	Machine::Machine(std::unique_ptr<Program> program) : program_{ std::move(program) } {}
+
+	Machine::~Machine() = default;
+
+	Machine::Machine(Machine&& other) noexcept = default;
+
+	Machine& Machine::operator=(Machine&& other) noexcept = default;
+
+	Status Machine::resume(std::uint64_t budget) { return program_->resume(budget); }
+
+	Status Machine::getStatus() const { return program_->getStatus(); }
+
+	Status Machine::run(IO& io) { return program_->run(io); }
+
+	void Machine::pushInput(std::int64_t value) { program_->pushInput(value); }
+
+	void Machine::pushInputs(const std::vector<std::int64_t>& values)
+	{
+		for (const auto value : values)
+			program_->pushInput(value);
+	}
+
+	bool Machine::hasOutput() const { return program_->hasOutput(); }
+
+	std::int64_t Machine::popOutput() { return program_->popOutput(); }
+
+	std::vector<std::int64_t> Machine::popOutputs()
+	{
+		auto outputs = std::vector<std::int64_t>{};
+		while (program_->hasOutput())
+			outputs.push_back(program_->popOutput());
+		return outputs;
+	}
+
+	std::uint64_t Machine::getNInstructions() const { return program_->getNInstructions(); }
+
+	std::vector<std::int64_t> Machine::releaseCode() { return program_->releaseCode(); }
+
+	Snapshot Machine::snapshot()
+	{
+		auto snapshot     = Snapshot{};
+		snapshot.program_ = program_->fork();
+		return snapshot;
+	}
+
+	Machine Machine::fork() { return Machine{ program_->fork() }; }
+
+	std::vector<std::int64_t> Machine::saveState() const
+	{
+		auto words = std::vector<std::int64_t>{};
+		program_->saveState(words);
+		return words;
+	}
+
+	Machine Machine::loadState(const std::int64_t* words, size_t nWords, const Options& options)
+	{
+		return Machine{ Program::loadState(words, nWords, options) };
+	}
+
+	Runner::Runner(std::vector<std::int64_t> code, const Options& options)
+	    : image_{ std::move(code) }, options_{ withoutJit(options) }, program_{ std::make_unique<Program>(image_, options_) }
+	{
+	}
+
+	Runner::~Runner() = default;
+
+	Runner::Runner(Runner&& other) noexcept = default;
+
+	Runner& Runner::operator=(Runner&& other) noexcept = default;
+
+	void Runner::reset()
+	{
+		program_->reset(image_);
+		outputs_.clear();
+	}
+
+	std::int64_t Runner::read(std::int64_t address) const { return program_->readMemory(address); }
+
+	void Runner::write(std::int64_t address, std::int64_t value) { program_->writeMemory(address, value); }
+
+	void Runner::pushInput(std::int64_t value) { program_->pushInput(value); }
+
+	void Runner::pushInputs(const std::vector<std::int64_t>& values)
+	{
+		for (const auto value : values)
+			program_->pushInput(value);
+	}
+
+	const std::vector<std::int64_t>& Runner::run()
+	{
+		for (;;) {
+			const auto status = program_->resume();
+			if (status == Status::Output) {
+				outputs_.push_back(program_->popOutput());
+				continue;
+			}
+
+			checkHalted(status);
+			if (options_.statistics)
+				options_.statistics->nInstructions += program_->getNInstructions();
+			return outputs_;
+		}
+	}
+
+	Status Runner::resume(std::uint64_t budget)
+	{
+		const auto budgetEnd = budget < unlimitedBudget - program_->getNInstructions() ? program_->getNInstructions() + budget : unlimitedBudget;
+		for (;;) {
+			const auto status = program_->resume(budgetEnd == unlimitedBudget ? unlimitedBudget : budgetEnd - program_->getNInstructions());
+			if (status == Status::Output) {
+				outputs_.push_back(program_->popOutput());
+				continue;
+			}
+			if (status == Status::Halted && options_.statistics)
+				options_.statistics->nInstructions += program_->getNInstructions();
+			return status;
+		}
+	}
+
+	Status Runner::run(IO& io)
+	{
+		const auto status = program_->run(io);
+		if (status == Status::Halted && options_.statistics)
+			options_.statistics->nInstructions += program_->getNInstructions();
+		return status;
+	}
+
+	Status Runner::getStatus() const { return program_->getStatus(); }
+
+	const std::vector<std::int64_t>& Runner::getImage() const { return program_->getImage(); }
+
+	std::uint64_t Runner::getNInstructions() const { return program_->getNInstructions(); }
+
 	std::vector<std::int64_t> run(const std::vector<std::int64_t>& code)
 	{
 		auto codeCopy = code;
 		return run(codeCopy, {});
 	}
 
-	std::vector<std::int64_t> run(const std::vector<std::int64_t>& code, const std::vector<std::int64_t>& inputs)
+	std::vector<std::int64_t> run(const std::vector<std::int64_t>& code, const std::vector<std::int64_t>& inputs, const Options& options)
 	{
 		auto codeCopy = code;
-		return run(codeCopy, inputs);
+		return run(codeCopy, inputs, options);
 	}
 
 	std::vector<std::int64_t> run(std::vector<std::int64_t>& code)
@@ -211,39 +829,53 @@ namespace opcode {
 		return run(code, {});
 	}
 
-	std::vector<std::int64_t> run(std::vector<std::int64_t>& code, const std::vector<std::int64_t>& inputs)
+	std::vector<std::int64_t> run(std::vector<std::int64_t>& code, const std::vector<std::int64_t>& inputs, const Options& options)
 	{
 		auto inputsCopy = inputs;
 		auto outputs    = std::vector<std::int64_t>{};
-		run(code, inputsCopy, outputs);
+		run(code, inputsCopy, outputs, options);
 		return outputs;
 	}
 
-	void run(const std::vector<std::int64_t>& code, std::vector<std::int64_t>& inputs, std::vector<std::int64_t>& outputs)
+	void run(const std::vector<std::int64_t>& code, std::vector<std::int64_t>& inputs, std::vector<std::int64_t>& outputs, const Options& options)
 	{
 		auto codeCopy = code;
-		return run(codeCopy, inputs, outputs);
+		return run(codeCopy, inputs, outputs, options);
 	}
 
-	void run(std::vector<std::int64_t>& code, std::vector<std::int64_t>& inputs, std::vector<std::int64_t>& outputs)
+	void run(std::vector<std::int64_t>& code, std::vector<std::int64_t>& inputs, std::vector<std::int64_t>& outputs, const Options& options)
 	{
-		const auto inputFunction = [&inputs]() {
-			const auto value = inputs.front();
-			inputs.erase(inputs.begin());
-			return value;
+		// Consumed inputs are erased once at the end rather than one at a time.
+		auto       next          = size_t{};
+		const auto inputFunction = [&inputs, &next]() {
+			if (next == inputs.size())
+				throw std::exception{ "no input available" };
+			return inputs[next++];
 		};
 		const auto outputFunction = [&outputs](std::int64_t value) { outputs.push_back(value); };
-		run(code, inputFunction, outputFunction);
+
+		auto status = Status::Halted;
+		try {
+			status = runDirect(code, inputFunction, outputFunction, options);
+		}
+		catch (...) {
+			inputs.erase(inputs.begin(), inputs.begin() + next);
+			throw;
+		}
+		inputs.erase(inputs.begin(), inputs.begin() + next);
+		checkHalted(status);
 	}
 
-	void run(const std::vector<std::int64_t>& code, std::function<std::int64_t()> inputFunction, std::function<void(std::int64_t)> outputFunction)
+	void run(const std::vector<std::int64_t>& code, std::function<std::int64_t()> inputFunction, std::function<void(std::int64_t)> outputFunction,
+	    const Options& options)
 	{
 		auto codeCopy = code;
-		return run(codeCopy, std::move(inputFunction), std::move(outputFunction));
+		return run(codeCopy, std::move(inputFunction), std::move(outputFunction), options);
 	}
 
-	void run(std::vector<std::int64_t>& code, std::function<std::int64_t()> inputFunction, std::function<void(std::int64_t)> outputFunction)
-	{ //
-		code = Program{ std::move(code), std::move(inputFunction), std::move(outputFunction) }.run().releaseCode();
+	void run(std::vector<std::int64_t>& code, std::function<std::int64_t()> inputFunction, std::function<void(std::int64_t)> outputFunction,
+	    const Options& options)
+	{
+		checkHalted(runDirect(code, inputFunction, outputFunction, options));
 	}
-}
+}
\ No newline at end of file
@@ -1,17 +1,278 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <functional>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace opcode {
+	enum class Backend { Interpreter, Decoded, Threaded, Jit };
+
+	struct Statistics
+	{
+		std::uint64_t nInstructions = 0;
+	};
+
+	// Stop request shared with running programs, in the manner of std::stop_source. A program given one in its options checks it every
+	// stopCheckInterval instructions and, once a stop is requested, returns from resume() with Status::Stopped; resuming it goes on where
+	// it stopped. The threaded and JIT backends run as the decoded one when stoppable.
+	class StopSource
+	{
+	public:
+		static constexpr std::uint64_t stopCheckInterval = 1024;
+
+		void requestStop() { isStopRequested_.store(true, std::memory_order_relaxed); }
+		bool isStopRequested() const { return isStopRequested_.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<bool> isStopRequested_{ false };
+	};
+
+	struct Profile;
+	class TraceBuffer;
+
+	constexpr std::uint64_t unlimitedBudget = std::numeric_limits<std::uint64_t>::max();
+
+	// A budget is the number of instructions a program may execute in total, or 0 for no limit. Once it is spent, resume() returns
+	// Status::Preempted and runs that need the program to halt throw.
+	struct Options
+	{
+		Backend           backend    = Backend::Decoded;
+		Statistics*       statistics = nullptr;
+		Profile*          profile    = nullptr;
+		TraceBuffer*      trace      = nullptr;
+		const StopSource* stop       = nullptr;
+		std::uint64_t     budget     = 0;
+	};
+
+	enum class Status { Running, NeedInput, Output, Halted, Stopped, Preempted };
+
+	// Returned by I/O policies to let the program go on or to leave it where it is. An input policy that can stop takes the value
+	// to read by reference.
+	enum class Control { Continue, Stop };
+
+	class Memory;
+	class Program;
+
+	namespace detail {
+		struct IO;
+	}
+
+	class Snapshot
+	{
+	private:
+		friend class Machine;
+
+		std::shared_ptr<const Program> program_;
+	};
+
+	class Machine
+	{
+	public:
+		explicit Machine(std::vector<std::int64_t> code, const Options& options = {});
+		explicit Machine(const Snapshot& snapshot);
+		Machine(Memory memory, std::int64_t position, std::int64_t relativeBase, const Options& options = {});
+		~Machine();
+
+		Machine(const Machine&) = delete;
+		Machine(Machine&& other) noexcept;
+		Machine& operator=(const Machine&) = delete;
+		Machine& operator=(Machine&& other) noexcept;
+
+		// Runs at most budget instructions before returning Status::Preempted, and can be resumed after that.
+		Status resume(std::uint64_t budget = unlimitedBudget);
+		Status getStatus() const;
+
+		// Runs until the program halts, a policy stops it or the budget in the options is spent. The decoded and threaded backends
+		// call the policies from inside their dispatch loops, through detail::IO: one indirect call per value, as for a std::function.
+		template<typename InputPolicy, typename OutputPolicy> Status run(InputPolicy& inputPolicy, OutputPolicy& outputPolicy);
+
+		void pushInput(std::int64_t value);
+		void pushInputs(const std::vector<std::int64_t>& values);
+
+		bool                      hasOutput() const;
+		std::int64_t              popOutput();
+		std::vector<std::int64_t> popOutputs();
+
+		std::uint64_t             getNInstructions() const;
+		std::vector<std::int64_t> releaseCode();
+
+		// Snapshots and forks share memory with this machine until written, and can be used from other threads. They keep the backend,
+		// stop source and budget, but not the profile, trace and statistics.
+		Snapshot snapshot();
+		Machine  fork();
+
+		// Flat copy of the memory, registers, instruction count and pending I/O, from which checkpoints are written.
+		std::vector<std::int64_t> saveState() const;
+		static Machine            loadState(const std::int64_t* words, size_t nWords, const Options& options = {});
+
+	private:
+		explicit Machine(std::unique_ptr<Program> program);
+
+		Status run(detail::IO& io);
+
+		std::unique_ptr<Program> program_;
+	};
+
+	// Runs one program many times. Memory, decoded instructions and I/O buffers are kept between runs, and reset() restores the
+	// pristine image in place by undoing only what the previous run changed, so repeated runs do not allocate. Backend::Jit runs as
+	// Backend::Decoded, whose decoded instructions are kept across resets where compiled blocks are not.
+	class Runner
+	{
+	public:
+		explicit Runner(std::vector<std::int64_t> code, const Options& options = {});
+		~Runner();
+
+		Runner(const Runner&) = delete;
+		Runner(Runner&& other) noexcept;
+		Runner& operator=(const Runner&) = delete;
+		Runner& operator=(Runner&& other) noexcept;
+
+		void reset();
+
+		std::int64_t read(std::int64_t address) const;
+		void         write(std::int64_t address, std::int64_t value);
+
+		void pushInput(std::int64_t value);
+		void pushInputs(const std::vector<std::int64_t>& values);
+
+		// Runs until the program halts, and throws if it needs an input that was not pushed yet, spends its budget or is stopped.
+		const std::vector<std::int64_t>& run();
+		Status                           getStatus() const;
+
+		// Runs until the program halts, needs an input that was not pushed yet or has spent the budget, appending what it outputs to getOutputs().
+		Status resume(std::uint64_t budget = unlimitedBudget);
+		void   clearOutputs() { outputs_.clear(); }
+
+		// As Machine::run(), with the outputs handed to the output policy rather than kept.
+		template<typename InputPolicy, typename OutputPolicy> Status run(InputPolicy& inputPolicy, OutputPolicy& outputPolicy);
+
+		const std::vector<std::int64_t>& getImage() const;
+		const std::vector<std::int64_t>& getOutputs() const { return outputs_; }
+		std::uint64_t                    getNInstructions() const;
+
+	private:
+		Status run(detail::IO& io);
+
+		std::vector<std::int64_t> image_;
+		Options                   options_;
+		std::unique_ptr<Program>  program_;
+		std::vector<std::int64_t> outputs_;
+	};
+
 	std::vector<std::int64_t> run(const std::vector<std::int64_t>& code);
-	std::vector<std::int64_t> run(const std::vector<std::int64_t>& code, const std::vector<std::int64_t>& inputs);
+	std::vector<std::int64_t> run(const std::vector<std::int64_t>& code, const std::vector<std::int64_t>& inputs, const Options& options = {});
 	std::vector<std::int64_t> run(std::vector<std::int64_t>& code);
-	std::vector<std::int64_t> run(std::vector<std::int64_t>& code, const std::vector<std::int64_t>& inputs);
+	std::vector<std::int64_t> run(std::vector<std::int64_t>& code, const std::vector<std::int64_t>& inputs, const Options& options = {});
+
+	void run(const std::vector<std::int64_t>& code, std::vector<std::int64_t>& inputs, std::vector<std::int64_t>& outputs, const Options& options = {});
+	void run(std::vector<std::int64_t>& code, std::vector<std::int64_t>& inputs, std::vector<std::int64_t>& outputs, const Options& options = {});
+	void run(const std::vector<std::int64_t>& code, std::function<std::int64_t()> inputFunction, std::function<void(std::int64_t)> outputFunction,
+	    const Options& options = {});
+	void run(std::vector<std::int64_t>& code, std::function<std::int64_t()> inputFunction, std::function<void(std::int64_t)> outputFunction,
+	    const Options& options = {});
+
+	namespace detail {
+		template<typename InputPolicy> auto readInput(InputPolicy& inputPolicy, std::int64_t& value, int) -> decltype(static_cast<Control>(inputPolicy(value)))
+		{
+			return inputPolicy(value);
+		}
+
+		template<typename InputPolicy> auto readInput(InputPolicy& inputPolicy, std::int64_t& value, long) -> decltype(static_cast<std::int64_t>(inputPolicy()), Control{})
+		{
+			value = static_cast<std::int64_t>(inputPolicy());
+			return Control::Continue;
+		}
+
+		template<typename OutputPolicy> auto writeOutput(OutputPolicy& outputPolicy, std::int64_t value, int) -> decltype(static_cast<Control>(outputPolicy(value)))
+		{
+			return outputPolicy(value);
+		}
+
+		template<typename OutputPolicy> auto writeOutput(OutputPolicy& outputPolicy, std::int64_t value, long) -> decltype(outputPolicy(value), Control{})
+		{
+			outputPolicy(value);
+			return Control::Continue;
+		}
+
+		template<typename InputPolicy, typename OutputPolicy> struct Policies
+		{
+			Control read(std::int64_t& value) { return readInput(inputPolicy, value, 0); }
+			Control write(std::int64_t value) { return writeOutput(outputPolicy, value, 0); }
+
+			InputPolicy&  inputPolicy;
+			OutputPolicy& outputPolicy;
+		};
+
+		// The policies as the dispatch loops see them. Program stays private to opcode.cpp, so the loops are compiled there once for this type
+		// and reach the policies through one function pointer per value. Inlining them into loops compiled per policy measured no faster.
+		struct IO
+		{
+			Control read(std::int64_t& value) { return readPolicy(policies, value); }
+			Control write(std::int64_t value) { return writePolicy(policies, value); }
+
+			void* policies;
+			Control (*readPolicy)(void* policies, std::int64_t& value);
+			Control (*writePolicy)(void* policies, std::int64_t value);
+		};
+
+		template<typename Policies> IO makeIO(Policies& policies)
+		{
+			return { &policies, [](void* p, std::int64_t& value) { return static_cast<Policies*>(p)->read(value); },
+				[](void* p, std::int64_t value) { return static_cast<Policies*>(p)->write(value); } };
+		}
+	}
+
+	template<typename InputPolicy, typename OutputPolicy> Status Machine::run(InputPolicy& inputPolicy, OutputPolicy& outputPolicy)
+	{
+		auto policies = detail::Policies<InputPolicy, OutputPolicy>{ inputPolicy, outputPolicy };
+		auto io       = detail::makeIO(policies);
+		return run(io);
+	}
+
+	template<typename InputPolicy, typename OutputPolicy> Status Runner::run(InputPolicy& inputPolicy, OutputPolicy& outputPolicy)
+	{
+		auto policies = detail::Policies<InputPolicy, OutputPolicy>{ inputPolicy, outputPolicy };
+		auto io       = detail::makeIO(policies);
+		return run(io);
+	}
+
+	template<typename InputPolicy, typename OutputPolicy>
+	using EnableIfIOPolicies = decltype(detail::readInput(std::declval<InputPolicy&>(), std::declval<std::int64_t&>(), 0),
+	    detail::writeOutput(std::declval<OutputPolicy&>(), std::int64_t{}, 0));
+
+	template<typename InputPolicy, typename OutputPolicy, typename = EnableIfIOPolicies<InputPolicy, OutputPolicy>>
+	Status run(Machine& machine, InputPolicy&& inputPolicy, OutputPolicy&& outputPolicy)
+	{ //
+		return machine.run(inputPolicy, outputPolicy);
+	}
+
+	template<typename InputPolicy, typename OutputPolicy, typename = EnableIfIOPolicies<InputPolicy, OutputPolicy>>
+	Status run(Runner& runner, InputPolicy&& inputPolicy, OutputPolicy&& outputPolicy)
+	{ //
+		return runner.run(inputPolicy, outputPolicy);
+	}
+
+	template<typename InputPolicy, typename OutputPolicy, typename = EnableIfIOPolicies<InputPolicy, OutputPolicy>>
+	Status run(std::vector<std::int64_t>& code, InputPolicy&& inputPolicy, OutputPolicy&& outputPolicy, const Options& options = {})
+	{
+		auto       machine = Machine{ std::move(code), options };
+		const auto status  = run(machine, inputPolicy, outputPolicy);
+
+		if (options.statistics)
+			options.statistics->nInstructions += machine.getNInstructions();
+		code = machine.releaseCode();
+		return status;
+	}
 
-	void run(const std::vector<std::int64_t>& code, std::vector<std::int64_t>& inputs, std::vector<std::int64_t>& outputs);
-	void run(std::vector<std::int64_t>& code, std::vector<std::int64_t>& inputs, std::vector<std::int64_t>& outputs);
-	void run(const std::vector<std::int64_t>& code, std::function<std::int64_t()> inputFunction, std::function<void(std::int64_t)> outputFunction);
-	void run(std::vector<std::int64_t>& code, std::function<std::int64_t()> inputFunction, std::function<void(std::int64_t)> outputFunction);
-}
\ No newline at end of file
+	template<typename InputPolicy, typename OutputPolicy, typename = EnableIfIOPolicies<InputPolicy, OutputPolicy>>
+	Status run(const std::vector<std::int64_t>& code, InputPolicy&& inputPolicy, OutputPolicy&& outputPolicy, const Options& options = {})
+	{
+		auto codeCopy = code;
+		return run(codeCopy, inputPolicy, outputPolicy, options);
+	}
+}
@@ -0,0 +1,178 @@
+#include "phase.h"
+
+#include <algorithm>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+
+namespace opcode {
+	namespace {
+		// 20! is the largest factorial that fits in 64 bits.
+		const size_t maxNPhases = 20;
+
+		std::uint64_t factorial(size_t n)
+		{
+			auto result = std::uint64_t{ 1 };
+			for (size_t i = 2; i <= n; ++i)
+				result *= i;
+			return result;
+		}
+
+		// Sets order to the ordering of 0, ..., n - 1 with this rank in lexicographic order.
+		void unrank(std::uint64_t rank, std::vector<size_t>& order)
+		{
+			std::iota(order.begin(), order.end(), size_t{ 0 });
+			for (size_t i = 0; i < order.size(); ++i) {
+				const auto nOrders = factorial(order.size() - 1 - i);
+				const auto j       = i + static_cast<size_t>(rank / nOrders);
+				rank %= nOrders;
+				std::rotate(order.begin() + i, order.begin() + j, order.begin() + j + 1);
+			}
+		}
+
+		// Equal phases are next to each other once sorted, and only the ordering that keeps them in that order is evaluated.
+		bool isDistinct(const std::vector<size_t>& order, const std::vector<std::int64_t>& phases, std::vector<size_t>& positions)
+		{
+			for (size_t i = 0; i < order.size(); ++i)
+				positions[order[i]] = i;
+			for (size_t k = 1; k < phases.size(); ++k)
+				if (phases[k] == phases[k - 1] && positions[k] < positions[k - 1])
+					return false;
+			return true;
+		}
+
+		Options withStatistics(Options options, Statistics& statistics)
+		{
+			options.statistics = &statistics;
+			return options;
+		}
+
+		struct Worker
+		{
+			Worker(const std::vector<std::int64_t>& code, size_t nPhases, const Options& options)
+			    : statistics{ std::make_unique<Statistics>() }, chain{ code, nPhases, withStatistics(options, *statistics) }, order(nPhases), positions(nPhases),
+			      phases(nPhases)
+			{
+			}
+
+			std::unique_ptr<Statistics> statistics;
+			AmplifierChain              chain;
+			std::vector<size_t>         order;
+			std::vector<size_t>         positions;
+			std::vector<std::int64_t>   phases;
+			std::int64_t                signal = std::numeric_limits<std::int64_t>::min();
+			std::uint64_t               rank   = std::numeric_limits<std::uint64_t>::max();
+		};
+	}
+
+	AmplifierChain::AmplifierChain(const std::vector<std::int64_t>& code, size_t nAmplifiers, const Options& options) : halted_(nAmplifiers)
+	{
+		amplifiers_.reserve(nAmplifiers);
+		for (size_t i = 0; i < nAmplifiers; ++i)
+			amplifiers_.emplace_back(code, options);
+	}
+
+	std::int64_t AmplifierChain::run(const std::vector<std::int64_t>& phases, std::int64_t input, bool feedback)
+	{
+		if (phases.size() != amplifiers_.size() || phases.empty())
+			throw std::exception{ "one phase per amplifier expected" };
+
+		for (size_t i = 0; i < amplifiers_.size(); ++i) {
+			amplifiers_[i].reset();
+			amplifiers_[i].pushInput(phases[i]);
+		}
+		amplifiers_.front().pushInput(input);
+		std::fill(halted_.begin(), halted_.end(), false);
+
+		auto signal    = std::int64_t{};
+		auto hasSignal = false;
+		auto nHalted   = size_t{ 0 };
+		while (nHalted < amplifiers_.size()) {
+			auto progress = false;
+			for (size_t i = 0; i < amplifiers_.size(); ++i) {
+				if (halted_[i])
+					continue;
+
+				auto&      amplifier = amplifiers_[i];
+				const auto status    = amplifier.resume();
+				if (status == Status::Preempted)
+					throw std::exception{ "instruction budget spent" };
+				if (status == Status::Stopped)
+					throw std::exception{ "run stopped" };
+
+				halted_[i] = status == Status::Halted;
+				nHalted += halted_[i] ? 1 : 0;
+
+				const auto& outputs = amplifier.getOutputs();
+				const auto  isLast  = i + 1 == amplifiers_.size();
+				progress            = progress || halted_[i] || !outputs.empty();
+				if (isLast && !outputs.empty()) {
+					signal    = outputs.back();
+					hasSignal = true;
+				}
+				if (!isLast || feedback)
+					for (const auto output : outputs)
+						amplifiers_[(i + 1) % amplifiers_.size()].pushInput(output);
+				amplifier.clearOutputs();
+			}
+			if (!progress)
+				throw std::exception{ "amplifiers are waiting for each other" };
+		}
+
+		if (!hasSignal)
+			throw std::exception{ "no signal out of the last amplifier" };
+		return signal;
+	}
+
+	PhaseSetting searchPhases(const std::vector<std::int64_t>& code, std::vector<std::int64_t> phases, bool feedback, const Options& options)
+	{
+		if (phases.empty() || phases.size() > maxNPhases)
+			throw std::exception{ "unsupported number of phases" };
+
+		std::sort(phases.begin(), phases.end());
+		const auto hasDuplicates = std::adjacent_find(phases.begin(), phases.end()) != phases.end();
+
+		tbb::enumerable_thread_specific<Worker> workers{ [&] { return Worker{ code, phases.size(), options }; } };
+
+		tbb::parallel_for(tbb::blocked_range<std::uint64_t>{ 0, factorial(phases.size()) }, [&](const tbb::blocked_range<std::uint64_t>& range) {
+			auto& worker = workers.local();
+			unrank(range.begin(), worker.order);
+			for (auto rank = range.begin(); rank != range.end(); ++rank, std::next_permutation(worker.order.begin(), worker.order.end())) {
+				if (hasDuplicates && !isDistinct(worker.order, phases, worker.positions))
+					continue;
+
+				for (size_t i = 0; i < phases.size(); ++i)
+					worker.phases[i] = phases[worker.order[i]];
+
+				const auto signal = worker.chain.run(worker.phases, 0, feedback);
+				if (signal > worker.signal || (signal == worker.signal && rank < worker.rank)) {
+					worker.signal = signal;
+					worker.rank   = rank;
+				}
+			}
+		});
+
+		auto best = std::numeric_limits<std::int64_t>::min();
+		auto rank = std::numeric_limits<std::uint64_t>::max();
+		for (const auto& worker : workers) {
+			if (worker.signal > best || (worker.signal == best && worker.rank < rank)) {
+				best = worker.signal;
+				rank = worker.rank;
+			}
+			if (options.statistics)
+				options.statistics->nInstructions += worker.statistics->nInstructions;
+		}
+
+		auto order = std::vector<size_t>(phases.size());
+		unrank(rank, order);
+
+		auto setting = PhaseSetting{ best, std::vector<std::int64_t>(phases.size()) };
+		for (size_t i = 0; i < phases.size(); ++i)
+			setting.phases[i] = phases[order[i]];
+		return setting;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "opcode.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace opcode {
+	// Amplifiers running the same program in a chain. Each one first reads its phase setting, then the previous one's outputs; the first
+	// one reads the input signal and, with feedback, the last one's outputs too. All of them run in turn on the calling thread, and the
+	// runners are kept between calls.
+	class AmplifierChain
+	{
+	public:
+		AmplifierChain(const std::vector<std::int64_t>& code, size_t nAmplifiers, const Options& options = {});
+
+		// Returns the last output of the last amplifier once every amplifier has halted. Throws if an amplifier spends its budget or is stopped.
+		std::int64_t run(const std::vector<std::int64_t>& phases, std::int64_t input, bool feedback);
+
+	private:
+		std::vector<Runner> amplifiers_;
+		std::vector<bool>   halted_;
+	};
+
+	struct PhaseSetting
+	{
+		std::int64_t              signal;
+		std::vector<std::int64_t> phases;
+	};
+
+	// Tries every distinct ordering of the phases, one amplifier per phase and a zero input signal, spread over the TBB scheduler.
+	// Returns the ordering giving the highest signal, the first in lexicographic order on ties.
+	PhaseSetting searchPhases(const std::vector<std::int64_t>& code, std::vector<std::int64_t> phases, bool feedback, const Options& options = {});
+}
\ No newline at end of file
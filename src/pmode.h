@@ -0,0 +1,8 @@
+#pragma once
+
+// The parameter modes of an instruction, shared by everything in the OpCode library that decodes instructions.
+namespace opcode {
+	namespace detail {
+		enum PMode { Position = 0, Immediate = 1, Relative = 2 };
+	}
+}
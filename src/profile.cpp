@@ -0,0 +1,82 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <string>
+#include <utility>
+
+namespace opcode {
+	namespace {
+		using Counts = std::vector<std::pair<std::int64_t, std::uint64_t>>;
+
+		const char* getName(std::int64_t op)
+		{
+			switch (op) {
+			case 1: return "add";
+			case 2: return "multiply";
+			case 3: return "input";
+			case 4: return "output";
+			case 5: return "jump-if-true";
+			case 6: return "jump-if-false";
+			case 7: return "less-than";
+			case 8: return "equals";
+			case 9: return "adjust-base";
+			default: return "unknown";
+			}
+		}
+
+		template<typename Map> Counts sortByCount(const Map& map)
+		{
+			auto counts = Counts{ map.begin(), map.end() };
+			std::sort(counts.begin(), counts.end(), [](const auto& a, const auto& b) { return a.second > b.second || (a.second == b.second && a.first < b.first); });
+			return counts;
+		}
+
+		template<typename Name> void writeSection(std::ostream& out, const std::string& title, const Counts& counts, std::uint64_t total, size_t nRows, Name name)
+		{
+			out << title << ":\n";
+			for (size_t i = 0; i < std::min(nRows, counts.size()); ++i) {
+				const auto percent = total ? 100.0 * counts[i].second / total : 0.0;
+				out << "  " << std::left << std::setw(16) << name(counts[i].first) << std::right << std::setw(14) << counts[i].second << std::setw(9)
+				    << std::fixed << std::setprecision(2) << percent << "%\n";
+			}
+		}
+	}
+
+	void writeReport(std::ostream& out, const Profile& profile, size_t nRows)
+	{
+		auto total = std::uint64_t{};
+		auto ops   = std::unordered_map<std::int64_t, std::uint64_t>{};
+		for (const auto& instruction : profile.instructions) {
+			total += instruction.second;
+			ops[instruction.first % 100] += instruction.second;
+		}
+
+		auto nReads  = std::uint64_t{};
+		auto nWrites = std::uint64_t{};
+		for (const auto& read : profile.reads)
+			nReads += read.second;
+		for (const auto& write : profile.writes)
+			nWrites += write.second;
+
+		const auto toString = [](std::int64_t value) { return std::to_string(value); };
+
+		out << "Instructions: " << total << "\n";
+		writeSection(out, "Opcodes", sortByCount(ops), total, nRows, getName);
+		writeSection(out, "Opcodes with parameter modes", sortByCount(profile.instructions), total, nRows, toString);
+		writeSection(out, "Positions", sortByCount(profile.positions), total, nRows, toString);
+		writeSection(out, "Reads", sortByCount(profile.reads), nReads, nRows, toString);
+		writeSection(out, "Writes", sortByCount(profile.writes), nWrites, nRows, toString);
+		out << "Memory growth events: " << profile.nGrowths << "\n";
+	}
+
+	void writeFoldedStacks(std::ostream& out, const Profile& profile)
+	{
+		for (const auto& stack : profile.stacks) {
+			out << "main";
+			for (const auto function : stack.first)
+				out << ";fn_" << function;
+			out << " " << stack.second << "\n";
+		}
+	}
+}
\ No newline at end of file
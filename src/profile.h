@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+namespace opcode {
+	// Filled by a Program when Options::profile is set. Counts accumulate over every run that shares the same profile.
+	struct Profile
+	{
+		std::unordered_map<std::int64_t, std::uint64_t>    instructions;
+		std::unordered_map<std::int64_t, std::uint64_t>    positions;
+		std::unordered_map<std::int64_t, std::uint64_t>    reads;
+		std::unordered_map<std::int64_t, std::uint64_t>    writes;
+		std::map<std::vector<std::int64_t>, std::uint64_t> stacks;
+		std::uint64_t                                      nGrowths = 0;
+	};
+
+	void writeReport(std::ostream& out, const Profile& profile, size_t nRows = 20);
+	void writeFoldedStacks(std::ostream& out, const Profile& profile);
+}
\ No newline at end of file
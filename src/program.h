@@ -0,0 +1,500 @@
+#pragma once
+
+#include "jit.h"
+#include "memory.h"
+#include "opcode.h"
+#include "pmode.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <vector>
+
+#if defined(_MSC_VER)
+#define OPCODE_INLINE __forceinline
+#else
+#define OPCODE_INLINE inline __attribute__((always_inline))
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define OPCODE_THREADED __attribute__((optimize("no-gcse", "no-crossjumping")))
+#else
+#define OPCODE_THREADED
+#endif
+
+// The program state and its dispatch loops, private to the OpCode library. The loops are templated on the queues and on detail::IO.
+namespace opcode {
+	namespace detail {
+
+		// Superinstructions that fuse a write with the jump that follows it, numbered after the real opcodes.
+		enum FusedOp { LessThanJumpIfTrue = 10, LessThanJumpIfFalse, EqualsJumpIfTrue, EqualsJumpIfFalse, AddJump, MultiplyJump, EndOfOps };
+
+		constexpr int getNPModes(int op)
+		{ //
+			return op == 3 ? 2 : op == 4 || op == 9 ? 3 : op == 5 || op == 6 ? 9 : 18;
+		}
+
+		constexpr int getPModesIndex(int op, int pMode1, int pMode2, int pMode3)
+		{
+			return op == 3 ? pMode1 / 2 : op == 4 || op == 9 ? pMode1 : op == 5 || op == 6 ? pMode1 * 3 + pMode2 : pMode1 * 6 + pMode2 * 2 + pMode3 / 2;
+		}
+
+		constexpr std::uint16_t getFirstHandler(int op) { return op == 1 ? 1 : getFirstHandler(op - 1) + getNPModes(op - 1); }
+
+		constexpr std::uint16_t getHandler(int op, int pMode1, int pMode2, int pMode3) { return getFirstHandler(op) + getPModesIndex(op, pMode1, pMode2, pMode3); }
+
+		constexpr std::uint16_t undecodedHandler = 0;
+		constexpr std::uint16_t haltHandler      = getFirstHandler(EndOfOps);
+		constexpr std::uint16_t fallbackHandler  = haltHandler + 1;
+
+// clang-format off
+#define OPCODE_WRITE_PMODES(X, op, m1, m2) X(op, m1, m2, 0) X(op, m1, m2, 2)
+#define OPCODE_BINARY_PMODES(X, op) \
+	OPCODE_WRITE_PMODES(X, op, 0, 0) OPCODE_WRITE_PMODES(X, op, 0, 1) OPCODE_WRITE_PMODES(X, op, 0, 2) \
+	OPCODE_WRITE_PMODES(X, op, 1, 0) OPCODE_WRITE_PMODES(X, op, 1, 1) OPCODE_WRITE_PMODES(X, op, 1, 2) \
+	OPCODE_WRITE_PMODES(X, op, 2, 0) OPCODE_WRITE_PMODES(X, op, 2, 1) OPCODE_WRITE_PMODES(X, op, 2, 2)
+#define OPCODE_JUMP_PMODES(X, op) \
+	X(op, 0, 0, 0) X(op, 0, 1, 0) X(op, 0, 2, 0) \
+	X(op, 1, 0, 0) X(op, 1, 1, 0) X(op, 1, 2, 0) \
+	X(op, 2, 0, 0) X(op, 2, 1, 0) X(op, 2, 2, 0)
+#define OPCODE_READ_PMODES(X, op) X(op, 0, 0, 0) X(op, 1, 0, 0) X(op, 2, 0, 0)
+#define OPCODE_HANDLERS(X) \
+	OPCODE_BINARY_PMODES(X, 1) OPCODE_BINARY_PMODES(X, 2) \
+	X(3, 0, 0, 0) X(3, 2, 0, 0) \
+	OPCODE_READ_PMODES(X, 4) \
+	OPCODE_JUMP_PMODES(X, 5) OPCODE_JUMP_PMODES(X, 6) \
+	OPCODE_BINARY_PMODES(X, 7) OPCODE_BINARY_PMODES(X, 8) \
+	OPCODE_READ_PMODES(X, 9) \
+	OPCODE_BINARY_PMODES(X, 10) OPCODE_BINARY_PMODES(X, 11) OPCODE_BINARY_PMODES(X, 12) \
+	OPCODE_BINARY_PMODES(X, 13) OPCODE_BINARY_PMODES(X, 14) OPCODE_BINARY_PMODES(X, 15)
+		// clang-format on
+
+		constexpr size_t maxInstructionSize = 7;
+
+		struct Instruction
+		{
+			std::uint16_t handler = undecodedHandler;
+			std::uint8_t  size    = 0;
+			std::int64_t  args[4] = {};
+		};
+
+		// Empty tag selecting the input() and output() overloads that use the program's own input and output vectors, as resume() does. A
+		// program run with it leaves its dispatch loop on every output and whenever it runs out of inputs.
+		struct Queues
+		{
+		};
+	}
+
+	class Program
+	{
+	public:
+		Program(std::vector<std::int64_t> code, const Options& options) : memory_{ std::move(code) }, options_{ options } {}
+		Program(Memory memory, std::int64_t position, std::int64_t relativeBase, const Options& options)
+		    : memory_{ std::move(memory) }, position_{ position }, relativeBase_{ relativeBase }, options_{ options }
+		{
+		}
+
+		Status resume(std::uint64_t budget = unlimitedBudget);
+		Status getStatus() const { return status_; }
+
+		// Runs until the program halts, is stopped or spends its budget, reading and writing through io from inside the decoded and
+		// threaded dispatch loops. The other backends, tracing and profiling go through resume() and the queues.
+		template<typename IO> Status run(IO& io);
+
+		void pushInput(std::int64_t value) { inputs_.push_back(value); }
+
+		bool         hasOutput() const { return nextOutput_ < outputs_.size(); }
+		std::int64_t popOutput();
+
+		std::vector<std::int64_t> releaseCode() { return memory_.releaseImage(); }
+
+		std::unique_ptr<Program> fork();
+
+		void reset(const std::vector<std::int64_t>& image);
+
+		std::int64_t                     readMemory(std::int64_t address) const { return memory_.read(address); }
+		void                             writeMemory(std::int64_t address, std::int64_t value) { write(address, value); }
+		const std::vector<std::int64_t>& getImage() const { return memory_.getImage(); }
+
+		std::uint64_t getNInstructions() const { return nInstructions_; }
+
+		void                            saveState(std::vector<std::int64_t>& words) const;
+		static std::unique_ptr<Program> loadState(const std::int64_t* words, size_t nWords, const Options& options);
+
+	private:
+		// Position, relative base, instruction count, status, then the sizes of the image, pages, inputs and outputs.
+		static constexpr size_t stateHeaderSize = 8;
+
+		struct PModes
+		{
+			std::int64_t pMode1, pMode2, pMode3;
+		};
+
+		bool start(std::uint64_t budget);
+		void dispatch();
+
+		void                                                        runInterpreter();
+		template<bool Traced, bool Checked, typename IO> void       runDecoded(IO& io);
+		template<typename IO> OPCODE_THREADED void                  runThreaded(IO& io);
+		void                                                        runJit();
+		void                                                        runProfiled();
+		void                                                        step();
+
+		bool checkInterrupts();
+
+		static std::int64_t jitRead(Jit::Context* context, std::int64_t address);
+		static bool         jitWrite(Jit::Context* context, std::int64_t address, std::int64_t value);
+
+		OPCODE_INLINE const detail::Instruction& fetch();
+		const detail::Instruction&               fetchUndecoded();
+		void                                     decode(size_t position, detail::Instruction& instruction);
+		void                                     fuse(size_t position, detail::Instruction& instruction, int op, int pMode1, int pMode2, int pMode3);
+		void                                     invalidate(size_t position);
+
+		template<int Op, int PMode1, int PMode2, int PMode3, typename IO> OPCODE_INLINE std::int64_t execute(const detail::Instruction& instruction, IO& io);
+		template<int Op, int PMode1, int PMode2, int PMode3, typename IO> OPCODE_INLINE void executeTraced(const detail::Instruction& instruction, IO& io);
+		void                                                                                 stepTraced();
+
+		template<int PMode> OPCODE_INLINE std::int64_t load(std::int64_t arg);
+		template<int PMode> OPCODE_INLINE void         store(std::int64_t arg, std::int64_t value);
+
+		// Reading or writing a value leaves the dispatch loop, with the status set, when the program has to wait or was stopped.
+		OPCODE_INLINE bool                             input(detail::Queues& io, std::int64_t& value);
+		template<typename IO> OPCODE_INLINE bool       input(IO& io, std::int64_t& value);
+		OPCODE_INLINE void                             output(detail::Queues& io, std::int64_t value);
+		template<typename IO> OPCODE_INLINE void       output(IO& io, std::int64_t value);
+
+		PModes       decodePModes();
+		std::int64_t getValuePosition(std::int64_t position, std::int64_t pMode);
+		std::int64_t getValue(std::int64_t position, std::int64_t pMode);
+		void         setValue(std::int64_t position, std::int64_t pMode, std::int64_t value);
+
+		OPCODE_INLINE std::int64_t read(std::int64_t position);
+		OPCODE_INLINE void         write(std::int64_t position, std::int64_t value);
+
+		// Inputs and outputs are kept in vectors that are cleared once drained, so feeding a program reuses the same storage.
+		bool         hasInput() const { return nextInput_ < inputs_.size(); }
+		std::int64_t popInput();
+
+		template<typename Operator> void  binaryOp(Operator op);
+		template<typename Predicate> void jumpIf(Predicate pred);
+
+		void add();
+		void multiply();
+		void readInput();
+		void writeOutput();
+		void jumpIfTrue();
+		void jumpIfFalse();
+		void lessThan();
+		void equals();
+		void adjustRelativeBase();
+
+		Memory                           memory_;
+		std::int64_t                     position_     = 0;
+		std::int64_t                     relativeBase_ = 0;
+		std::vector<std::int64_t>        inputs_;
+		size_t                           nextInput_ = 0;
+		std::vector<std::int64_t>        outputs_;
+		size_t                           nextOutput_ = 0;
+		Status                           status_ = Status::Running;
+		Options                          options_;
+		std::vector<detail::Instruction> decoded_;
+		std::vector<bool>                decodedPositions_;
+		std::uint64_t                    nInstructions_ = 0;
+		std::uint64_t                    budgetEnd_     = unlimitedBudget;
+		std::uint64_t                    checkpoint_    = unlimitedBudget;
+		Jit                              jit_;
+		std::exception_ptr               jitException_;
+		std::vector<std::int64_t>        profileFrames_;
+		std::vector<std::int64_t>        profileReturns_;
+		std::int64_t                     profileLastWrite_ = -1;
+	};
+
+	template<typename IO> Status Program::run(IO& io)
+	{
+		auto value = std::int64_t{};
+		for (;;) {
+			if (start(unlimitedBudget)) {
+				if (options_.profile || options_.trace || options_.backend == Backend::Interpreter || options_.backend == Backend::Jit)
+					dispatch();
+				else if (checkpoint_ != unlimitedBudget)
+					runDecoded<false, true>(io);
+				else if (options_.backend == Backend::Threaded)
+					runThreaded(io);
+				else
+					runDecoded<false, false>(io);
+			}
+
+			// Instructions the decoder leaves to step() and the other backends still go through the queues.
+			switch (status_) {
+			case Status::NeedInput:
+				if (!input(io, value))
+					return status_;
+				pushInput(value);
+				break;
+			case Status::Output:
+				output(io, popOutput());
+				if (status_ == Status::Stopped)
+					return status_;
+				break;
+			default: return status_;
+			}
+		}
+	}
+
+	template<bool Traced, bool Checked, typename IO> void Program::runDecoded(IO& io)
+	{
+		for (;;) {
+			const auto& instruction = fetch();
+
+			if (Checked && nInstructions_ + 1 >= checkpoint_) {
+				if (checkInterrupts())
+					return;
+
+				// A fused pair counts as two instructions, one too many when a single one is left in the budget.
+				if (instruction.size == 7 && nInstructions_ + 1 == budgetEnd_) {
+					if (Traced)
+						stepTraced();
+					else
+						step();
+					if (status_ != Status::Running)
+						return;
+					continue;
+				}
+			}
+
+			switch (instruction.handler) {
+#define OPCODE_CASE(op, m1, m2, m3)                             \
+	case detail::getHandler(op, m1, m2, m3):                    \
+		if (Traced)                                             \
+			executeTraced<op, m1, m2, m3>(instruction, io);     \
+		else                                                    \
+			execute<op, m1, m2, m3>(instruction, io);           \
+		if ((op == 3 || op == 4) && status_ != Status::Running) \
+			return;                                             \
+		break;
+				OPCODE_HANDLERS(OPCODE_CASE)
+#undef OPCODE_CASE
+			case detail::haltHandler: status_ = Status::Halted; return;
+			default:
+				if (read(position_) % 100 == 99) {
+					status_ = Status::Halted;
+					return;
+				}
+				if (Traced)
+					stepTraced();
+				else
+					step();
+				if (status_ != Status::Running)
+					return;
+				break;
+			}
+		}
+	}
+
+	template<typename IO> OPCODE_THREADED void Program::runThreaded(IO& io)
+	{
+#if defined(__GNUC__)
+#define OPCODE_LABEL_ADDRESS(op, m1, m2, m3) &&handler_##op##_##m1##_##m2##_##m3,
+		static void* const labels[] = { &&fallback, OPCODE_HANDLERS(OPCODE_LABEL_ADDRESS) &&halt, &&fallback };
+#undef OPCODE_LABEL_ADDRESS
+		static_assert(sizeof(labels) / sizeof(labels[0]) == detail::fallbackHandler + 1, "handler labels do not match handler ids");
+
+		const detail::Instruction* instruction = nullptr;
+
+#define OPCODE_DISPATCH()   \
+	instruction = &fetch(); \
+	goto* labels[instruction->handler];
+#define OPCODE_LABEL(op, m1, m2, m3)                        \
+	handler_##op##_##m1##_##m2##_##m3:                      \
+	execute<op, m1, m2, m3>(*instruction, io);              \
+	if ((op == 3 || op == 4) && status_ != Status::Running) \
+		return;                                             \
+	OPCODE_DISPATCH()
+
+		OPCODE_DISPATCH();
+		OPCODE_HANDLERS(OPCODE_LABEL)
+
+	fallback:
+		if (read(position_) % 100 == 99) {
+			status_ = Status::Halted;
+			return;
+		}
+		step();
+		if (status_ != Status::Running)
+			return;
+		OPCODE_DISPATCH();
+
+	halt:
+		status_ = Status::Halted;
+#undef OPCODE_LABEL
+#undef OPCODE_DISPATCH
+#else
+		runDecoded<false, false>(io);
+#endif
+	}
+
+	const detail::Instruction& Program::fetch()
+	{
+		const auto position = static_cast<size_t>(position_);
+		if (position < decoded_.size() && decoded_[position].handler != detail::undecodedHandler)
+			return decoded_[position];
+		return fetchUndecoded();
+	}
+
+	template<int Op, int PMode1, int PMode2, int PMode3, typename IO> std::int64_t Program::execute(const detail::Instruction& instruction, IO& io)
+	{
+		using namespace detail;
+
+		const auto* args = instruction.args;
+		const auto  size = instruction.size;
+
+		auto value = std::int64_t{};
+		switch (Op) {
+		case 1: store<PMode3>(args[2], value = load<PMode1>(args[0]) + load<PMode2>(args[1])); break;
+		case 2: store<PMode3>(args[2], value = load<PMode1>(args[0]) * load<PMode2>(args[1])); break;
+		case 3:
+			if (!input(io, value))
+				return value;
+			store<PMode1>(args[0], value);
+			break;
+		case 4: output(io, value = load<PMode1>(args[0])); break;
+		case 5:
+		case 6:
+			if ((load<PMode1>(args[0]) != 0) == (Op == 5)) {
+				position_ = load<PMode2>(args[1]);
+				++nInstructions_;
+				return value;
+			}
+			break;
+		case 7: store<PMode3>(args[2], value = load<PMode1>(args[0]) < load<PMode2>(args[1]) ? 1 : 0); break;
+		case 8: store<PMode3>(args[2], value = load<PMode1>(args[0]) == load<PMode2>(args[1]) ? 1 : 0); break;
+		case 9: value = relativeBase_ += load<PMode1>(args[0]); break;
+		case LessThanJumpIfTrue:
+		case LessThanJumpIfFalse:
+		case EqualsJumpIfTrue:
+		case EqualsJumpIfFalse:
+		case AddJump:
+		case MultiplyJump: {
+			const auto a       = load<PMode1>(args[0]);
+			const auto b       = load<PMode2>(args[1]);
+			const auto address = PMode3 == Relative ? relativeBase_ + args[2] : args[2];
+			const auto target  = args[3];
+			value              = Op == AddJump ? a + b : Op == MultiplyJump ? a * b : (Op < EqualsJumpIfTrue ? a < b : a == b) ? 1 : 0;
+			write(address, value);
+
+			// Writing into the fused pair changes the jump, which then has to be decoded again on its own.
+			if (static_cast<std::uint64_t>(address - position_) < size) {
+				position_ += 4;
+				++nInstructions_;
+				return value;
+			}
+
+			const auto jumps = Op == AddJump || Op == MultiplyJump || (value != 0) == (Op == LessThanJumpIfTrue || Op == EqualsJumpIfTrue);
+			position_        = jumps ? target : position_ + size;
+			nInstructions_ += 2;
+			return value;
+		}
+		}
+		position_ += size;
+		++nInstructions_;
+		return value;
+	}
+
+	template<int Op, int PMode1, int PMode2, int PMode3, typename IO> void Program::executeTraced(const detail::Instruction& instruction, IO& io)
+	{
+		using namespace detail;
+
+		// Fused pairs are traced as the two instructions they replace.
+		constexpr auto op      = Op == AddJump ? 1 : Op == MultiplyJump ? 2 : Op >= EqualsJumpIfTrue ? 8 : Op >= LessThanJumpIfTrue ? 7 : Op;
+		constexpr auto isFused = Op >= LessThanJumpIfTrue;
+		constexpr auto opCode  = op + PMode1 * 100 + PMode2 * 1000 + PMode3 * 10000;
+
+		const auto position      = position_;
+		const auto nInstructions = nInstructions_;
+		auto&      trace         = *options_.trace;
+		auto&      record        = trace.claim();
+		record.position          = position;
+		record.opCode            = opCode;
+		record.args[0]           = instruction.args[0];
+		record.args[1]           = instruction.args[1];
+		record.args[2]           = instruction.args[2];
+
+		const auto value = execute<Op, PMode1, PMode2, PMode3>(instruction, io);
+		if (nInstructions_ == nInstructions)
+			return;
+
+		record.value = op == 5 || op == 6 ? position_ : value;
+		trace.commit();
+
+		if (isFused && nInstructions_ - nInstructions == 2) {
+			auto& jump    = trace.claim();
+			jump.position = position + 4;
+			jump.opCode   = read(position + 4);
+			jump.args[0]  = read(position + 5);
+			jump.args[1]  = read(position + 6);
+			jump.args[2]  = 0;
+			jump.value    = position_;
+			trace.commit();
+		}
+	}
+
+	template<int PMode> std::int64_t Program::load(std::int64_t arg)
+	{
+		switch (PMode) {
+		case detail::Position: return read(arg);
+		case detail::Immediate: return arg;
+		default: return read(relativeBase_ + arg);
+		}
+	}
+
+	template<int PMode> void Program::store(std::int64_t arg, std::int64_t value)
+	{ //
+		write(PMode == detail::Relative ? relativeBase_ + arg : arg, value);
+	}
+
+	bool Program::input(detail::Queues&, std::int64_t& value)
+	{
+		if (!hasInput()) {
+			status_ = Status::NeedInput;
+			return false;
+		}
+		value = popInput();
+		return true;
+	}
+
+	template<typename IO> bool Program::input(IO& io, std::int64_t& value)
+	{
+		if (io.read(value) == Control::Stop) {
+			status_ = Status::Stopped;
+			return false;
+		}
+		return true;
+	}
+
+	void Program::output(detail::Queues&, std::int64_t value)
+	{
+		outputs_.push_back(value);
+		status_ = Status::Output;
+	}
+
+	template<typename IO> void Program::output(IO& io, std::int64_t value)
+	{
+		if (io.write(value) == Control::Stop)
+			status_ = Status::Stopped;
+	}
+
+	std::int64_t Program::read(std::int64_t position)
+	{ //
+		return memory_.read(position);
+	}
+
+	void Program::write(std::int64_t position, std::int64_t value)
+	{
+		memory_.write(position, value);
+
+		if (static_cast<size_t>(position) < decodedPositions_.size() && decodedPositions_[position])
+			invalidate(static_cast<size_t>(position));
+	}
+}
@@ -0,0 +1,77 @@
+#include "sweep.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_group.h>
+
+namespace opcode {
+	namespace {
+		struct Worker
+		{
+			Runner        runner;
+			std::uint64_t nInstructions;
+		};
+
+		bool runTrial(const Trial& trial, const TrialPredicate& predicate, Worker& worker)
+		{
+			auto& runner = worker.runner;
+			runner.reset();
+
+			auto halted = true;
+			try {
+				for (const auto& patch : trial.patches)
+					runner.write(patch.first, patch.second);
+				runner.pushInputs(trial.inputs);
+				runner.run();
+				halted = runner.getStatus() == Status::Halted;
+			}
+			catch (const std::exception&) {
+				halted = false;
+			}
+			worker.nInstructions += runner.getNInstructions();
+			return halted && predicate(runner.getImage(), runner.getOutputs());
+		}
+	}
+
+	boost::optional<size_t> sweep(
+	    const std::vector<std::int64_t>& image, const std::vector<Trial>& trials, const TrialPredicate& predicate, const Options& options)
+	{
+		// Trials still running when one is accepted are stopped rather than run to the end.
+		StopSource stop;
+		auto       runnerOptions = options;
+		runnerOptions.statistics = nullptr;
+		runnerOptions.stop       = &stop;
+
+		tbb::enumerable_thread_specific<Worker> workers{ [&] { return Worker{ Runner{ image, runnerOptions }, 0 }; } };
+		tbb::task_group_context                 context;
+		std::atomic<size_t>                     match{ trials.size() };
+
+		tbb::parallel_for(
+		    tbb::blocked_range<size_t>{ 0, trials.size() },
+		    [&](const tbb::blocked_range<size_t>& range) {
+			    auto& worker = workers.local();
+			    for (auto i = range.begin(); i != range.end() && !context.is_group_execution_cancelled(); ++i) {
+				    if (runTrial(trials[i], predicate, worker)) {
+					    auto current = match.load();
+					    while (i < current && !match.compare_exchange_weak(current, i)) {
+					    }
+					    stop.requestStop();
+					    context.cancel_group_execution();
+				    }
+			    }
+		    },
+		    context);
+
+		if (options.statistics)
+			for (const auto& worker : workers)
+				options.statistics->nInstructions += worker.nInstructions;
+
+		if (match == trials.size())
+			return boost::none;
+		return match.load();
+	}
+}
\ No newline at end of file
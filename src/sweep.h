@@ -0,0 +1,25 @@
+#pragma once
+
+#include "opcode.h"
+
+#include <boost/optional.hpp>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace opcode {
+	struct Trial
+	{
+		std::vector<std::pair<std::int64_t, std::int64_t>> patches;
+		std::vector<std::int64_t>                          inputs;
+	};
+
+	using TrialPredicate = std::function<bool(const std::vector<std::int64_t>& memory, const std::vector<std::int64_t>& outputs)>;
+
+	// Runs each trial on its own patched copy of the image, spread over the TBB scheduler, and returns the index of a trial accepted
+	// by the predicate. Trials that fail are skipped, and the remaining ones are cancelled as soon as one is accepted. The trial returned is
+	// any accepted one, not necessarily the first, so searches that need every result, the best one or the first one are not sweeps.
+	boost::optional<size_t> sweep(const std::vector<std::int64_t>& image, const std::vector<Trial>& trials, const TrialPredicate& predicate,
+	    const Options& options = {});
+}
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include "trace.h"
+#include "pmode.h"
+
+#include <algorithm>
+#include <exception>
+#include <string>
+
+namespace opcode {
+	namespace {
+		const std::uint64_t traceMagic = 0x31525443544e49; // "INTCTR1"
+		const size_t        chunkSize  = size_t{ 1 } << 12;
+
+		using namespace detail;
+
+		size_t roundUpToPowerOfTwo(size_t value)
+		{
+			auto result = size_t{ 1 };
+			while (result < value)
+				result <<= 1;
+			return result;
+		}
+
+		const char* getMnemonic(std::int64_t op)
+		{
+			switch (op) {
+			case 1: return "add";
+			case 2: return "mul";
+			case 3: return "in";
+			case 4: return "out";
+			case 5: return "jnz";
+			case 6: return "jz";
+			case 7: return "lt";
+			case 8: return "eq";
+			case 9: return "arb";
+			default: return "???";
+			}
+		}
+
+		int getNArgs(std::int64_t op) { return op == 3 || op == 4 || op == 9 ? 1 : op == 5 || op == 6 ? 2 : op >= 1 && op <= 8 ? 3 : 0; }
+
+		std::string toOperand(std::int64_t arg, std::int64_t pMode)
+		{
+			switch (pMode) {
+			case Position: return "[" + std::to_string(arg) + "]";
+			case Immediate: return std::to_string(arg);
+			case Relative: return "[rb" + std::string{ arg < 0 ? "" : "+" } + std::to_string(arg) + "]";
+			default: return "?" + std::to_string(arg);
+			}
+		}
+	}
+
+	TraceBuffer::TraceBuffer(size_t capacity) : records_(roundUpToPowerOfTwo(std::max(capacity, size_t{ 1 }))), mask_{ records_.size() - 1 } {}
+
+	std::vector<TraceRecord> TraceBuffer::getRecords() const
+	{
+		const auto capacity = static_cast<std::uint64_t>(records_.size());
+		const auto last     = head_.load(std::memory_order_acquire);
+		const auto first    = last > capacity ? last - capacity : 0;
+
+		auto records = std::vector<TraceRecord>{};
+		records.reserve(static_cast<size_t>(last - first));
+		for (auto i = first; i != last; ++i)
+			records.push_back(records_[i & mask_]);
+
+		// The writer may have lapped the copy, in which case the oldest records were overwritten and are dropped.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		const auto claimed = claimed_.load(std::memory_order_relaxed);
+		const auto valid   = claimed > capacity ? claimed - capacity : 0;
+		const auto nStale = std::min(valid > first ? valid - first : 0, static_cast<std::uint64_t>(records.size()));
+		records.erase(records.begin(), records.begin() + static_cast<std::ptrdiff_t>(nStale));
+		return records;
+	}
+
+	void writeTrace(std::ostream& out, const TraceBuffer& buffer)
+	{
+		const auto records  = buffer.getRecords();
+		const auto nRecords = static_cast<std::uint64_t>(records.size());
+		out.write(reinterpret_cast<const char*>(&traceMagic), sizeof(traceMagic));
+		out.write(reinterpret_cast<const char*>(&nRecords), sizeof(nRecords));
+		out.write(reinterpret_cast<const char*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(TraceRecord)));
+	}
+
+	std::vector<TraceRecord> readTrace(std::istream& in)
+	{
+		auto magic    = std::uint64_t{};
+		auto nRecords = std::uint64_t{};
+		in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+		in.read(reinterpret_cast<char*>(&nRecords), sizeof(nRecords));
+		if (!in || magic != traceMagic)
+			throw std::exception{ "not an intcode trace" };
+
+		// Read by chunks, so that a corrupted count fails on the end of the stream rather than on a huge allocation.
+		auto records = std::vector<TraceRecord>{};
+		while (records.size() < nRecords) {
+			const auto offset = records.size();
+			records.resize(offset + static_cast<size_t>(std::min<std::uint64_t>(nRecords - offset, chunkSize)));
+			in.read(reinterpret_cast<char*>(records.data() + offset), static_cast<std::streamsize>((records.size() - offset) * sizeof(TraceRecord)));
+			if (!in)
+				throw std::exception{ "truncated intcode trace" };
+		}
+		return records;
+	}
+
+	void writeTraceText(std::ostream& out, const std::vector<TraceRecord>& records)
+	{
+		for (const auto& record : records) {
+			const auto op    = record.opCode % 100;
+			const auto nArgs = getNArgs(op);
+
+			auto line = std::to_string(record.position) + ": " + getMnemonic(op);
+			auto mode = record.opCode / 100;
+			for (auto i = 0; i < nArgs; ++i, mode /= 10)
+				line += (i == 0 ? " " : ", ") + toOperand(record.args[i], mode % 10);
+
+			switch (op) {
+			case 4: line += " => " + std::to_string(record.value); break;
+			case 5:
+			case 6: line += record.value == record.position + 3 ? "" : " -> " + std::to_string(record.value); break;
+			case 9: line += " ; rb = " + std::to_string(record.value); break;
+			default: line += " <- " + std::to_string(record.value); break;
+			}
+			out << line << "\n";
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+namespace opcode {
+	// One executed instruction. The value is what the instruction wrote, output or jumped to, or the new relative base for opcode 9.
+	struct TraceRecord
+	{
+		std::int64_t position;
+		std::int64_t opCode;
+		std::int64_t args[3];
+		std::int64_t value;
+	};
+
+	// Fixed-size ring of the most recent records, written by the thread running the program. The writer never blocks nor allocates,
+	// and records can be read from any thread; those overwritten while being copied are dropped.
+	class TraceBuffer
+	{
+	public:
+		explicit TraceBuffer(size_t capacity = size_t{ 1 } << 12);
+
+		TraceBuffer(const TraceBuffer&) = delete;
+		TraceBuffer& operator=(const TraceBuffer&) = delete;
+
+		// The writer fills the claimed record in place and commits it to make it visible. Claiming again without committing reuses the same record.
+		TraceRecord& claim()
+		{
+			const auto head = head_.load(std::memory_order_relaxed);
+			claimed_.store(head + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			return records_[head & mask_];
+		}
+
+		void commit() { head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+		void push(const TraceRecord& record)
+		{
+			claim() = record;
+			commit();
+		}
+
+		size_t        getCapacity() const { return records_.size(); }
+		std::uint64_t getNRecords() const { return head_.load(std::memory_order_acquire); }
+
+		std::vector<TraceRecord> getRecords() const;
+
+	private:
+		std::vector<TraceRecord>   records_;
+		std::uint64_t              mask_;
+		std::atomic<std::uint64_t> head_{ 0 };
+		std::atomic<std::uint64_t> claimed_{ 0 };
+	};
+
+	void                     writeTrace(std::ostream& out, const TraceBuffer& buffer);
+	std::vector<TraceRecord> readTrace(std::istream& in);
+
+	void writeTraceText(std::ostream& out, const std::vector<TraceRecord>& records);
+}
\ No newline at end of file